@@ -0,0 +1,65 @@
+/*
+ * libtest.c
+ *
+ * libmperft test: two threads count two positions with perft() on a shared hashtable.
+ *
+ * © 2020-2056 Richard Delorme
+ * version 2.0
+ */
+
+/* Includes */
+#include "mperft.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Test of a thread */
+typedef struct LibTest {
+	const MPerft *mperft;
+	HashTable *hashtable;
+	char *fen;
+	int depth;
+	uint64_t expected;
+	uint64_t count;
+} LibTest;
+
+/* Count the leaves of a position, twice: once in an empty, then in a full hashtable */
+static void* libtest_run(void *data) {
+	LibTest *test = data;
+	Board board;
+
+	if (!board_set(&board, test->mperft, test->fen)) return NULL;
+	test->count = perft(&board, test->hashtable, test->depth, true, true);
+	if (test->count == test->expected) test->count = perft(&board, test->hashtable, test->depth, true, true);
+
+	return NULL;
+}
+
+/* main */
+int main(void) {
+	char startpos[] = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+	char kiwipete[] = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1";
+	MPerft *mperft = mperft_create(0xA170EBA);
+	HashTable *hashtable = hash_create(16, false);
+	LibTest test[2] = {
+		{mperft, hashtable, startpos, 6, 119060324, 0},
+		{mperft, hashtable, kiwipete, 5, 193690690, 0},
+	};
+	pthread_t thread[2];
+	bool ok = true;
+	int i;
+
+	if (mperft == NULL || hashtable == NULL) return EXIT_FAILURE;
+	hash_reset(hashtable);
+	for (i = 0; i < 2; ++i) if (pthread_create(thread + i, NULL, libtest_run, test + i)) libtest_run(test + i), thread[i] = 0;
+	for (i = 0; i < 2; ++i) if (thread[i]) pthread_join(thread[i], NULL);
+	for (i = 0; i < 2; ++i) {
+		printf("Test libmperft %s: %llu leaves at depth %d", test[i].fen, (unsigned long long) test[i].count, test[i].depth);
+		if (test[i].count == test[i].expected) printf(" passed\n");
+		else printf(" FAILED ! != %llu\n", (unsigned long long) test[i].expected), ok = false;
+	}
+	hash_destroy(hashtable);
+	mperft_destroy(mperft);
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,275 @@
+/*
+ * main.c
+ *
+ * mperft command line: a thin wrapper around libmperft.
+ *
+ * © 2020-2056 Richard Delorme
+ * version 2.0
+ */
+
+/* Includes */
+#include "mperft.h"
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Progress dump request, set on SIGUSR1 */
+static volatile sig_atomic_t PROGRESS_DUMP;
+
+static void progress_signal(int sig) {
+	(void) sig;
+	PROGRESS_DUMP = 1;
+}
+
+/* Stop on a 64-bit count saturated by an overflow */
+static uint64_t count_check(const uint64_t count) {
+	if (count == UINT64_MAX) {
+		fprintf(stderr, "Fatal Error: the 64-bit leaf count overflows; count without --iterative, --hash-verify or --symmetry\n");
+		exit(EXIT_FAILURE);
+	}
+	return count;
+}
+
+/* main */
+int main(int argc, char **argv) {
+	double full_time= -mperft_chrono(), partial_time = 0.0, total_time = 0.0;
+	alignas(64) Board board;
+	MPerft *mperft;
+	HashTable *hashtable = NULL;
+	Count count, total = 0;
+	uint64_t seed = 0xA170EBA, unique_count;
+	char *fen = NULL;
+	int depth = 6, hash_size = 0, n_repetition = 1;
+	Stats stats, total_stats = {0};
+	char *socket_path = NULL, *hash_name = NULL;
+	Numa numa = {.policy = NUMA_NONE, .affinity = AFFINITY_NONE};
+	int numa_nodes = 0, n_threads = 0, estimate_exact = -1, corpus = 0;
+	double estimate = 0.0, progress = 0.0;
+	char *progress_path = NULL, *corpus_path = NULL;
+	bool numa_report = false;
+	PerftSearch *search = NULL;
+	bool div = false, capture = false, bulk = false, loop = false, detailed = false, serve = false, iterative = false, symmetry = false, cold = false, verify = false, adapt = false, unique = false;
+
+	puts("Magic Perft (c) version 2.0 Richard Delorme - 2026");
+#if HAS_PEXT
+	puts("Bitboard move generation based on magic (pext) bitboards");
+#else
+	puts("Bitboard move generation based on magic bitboards");
+#endif
+
+
+	// argument
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--fen") || !strcmp(argv[i], "-f")) fen = argv[++i];
+		else if (!strcmp(argv[i], "--kiwipete") || !strcmp(argv[i], "-k")) fen = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1";
+		else if (!strcmp(argv[i], "--depth") || !strcmp(argv[i], "-d")) depth = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--bulk") || !strcmp(argv[i], "-b")) bulk = true;
+		else if (!strcmp(argv[i], "--div")) div = true;
+		else if (!strcmp(argv[i], "--detailed")) detailed = true;
+		else if (!strcmp(argv[i], "--iterative")) iterative = true;
+		else if (!strcmp(argv[i], "--symmetry")) symmetry = true;
+		else if (!strcmp(argv[i], "--cold")) cold = true;
+		else if (!strcmp(argv[i], "--hash-verify")) verify = true;
+		else if (!strcmp(argv[i], "--warm")) cold = false;
+		else if (!strcmp(argv[i], "--unique")) unique = true;
+		else if (!strcmp(argv[i], "--server")) serve = true;
+		else if (i < argc - 1 && !strcmp(argv[i], "--socket")) serve = true, socket_path = argv[++i];
+		else if (!strcmp(argv[i], "--capture") || !strcmp(argv[i], "-c")) capture = true;
+		else if (!strcmp(argv[i], "--loop") || !strcmp(argv[i], "-l")) loop = true;
+		else if (isdigit((int) argv[i][0])) depth = atoi(argv[i]);
+		else if (i < argc - 1 && (!strcmp(argv[i], "--repeat") || !strcmp(argv[i], "-r"))) n_repetition=atoi(argv[++i]);
+		else if (i < argc - 1 && (!strcmp(argv[i], "--hash") || !strcmp(argv[i], "-h"))) {
+			++i;
+			hash_size = strcmp(argv[i], "auto") ? atoi(argv[i]) : -1;
+		} else if (i < argc - 1 && !strcmp(argv[i], "--hash-shm")) hash_name = argv[++i];
+		else if (i < argc - 1 && !strcmp(argv[i], "--hash-policy")) adapt = !strcmp(argv[++i], "auto");
+		else if (i < argc - 1 && !strcmp(argv[i], "--numa")) {
+			++i; numa_report = true;
+			if (!strcmp(argv[i], "interleave")) numa.policy = NUMA_INTERLEAVE;
+			else if (!strcmp(argv[i], "partition")) numa.policy = NUMA_PARTITION;
+			else numa.policy = NUMA_NONE;
+		} else if (i < argc - 1 && !strcmp(argv[i], "--affinity")) {
+			++i;
+			if (!strcmp(argv[i], "compact")) numa.affinity = AFFINITY_COMPACT;
+			else if (!strcmp(argv[i], "scatter")) numa.affinity = AFFINITY_SCATTER;
+			else numa.affinity = AFFINITY_NONE;
+		} else if (i < argc - 1 && !strcmp(argv[i], "--numa-nodes")) numa_nodes = atoi(argv[++i]);
+		else if (i < argc - 1 && (!strcmp(argv[i], "--threads") || !strcmp(argv[i], "-j"))) n_threads = atoi(argv[++i]);
+		else if (i < argc - 1 && !strcmp(argv[i], "--progress")) progress = atof(argv[++i]);
+		else if (i < argc - 1 && !strcmp(argv[i], "--progress-file")) progress_path = argv[++i];
+		else if (i < argc - 1 && !strcmp(argv[i], "--estimate")) estimate = atof(argv[++i]);
+		else if (i < argc - 1 && !strcmp(argv[i], "--estimate-exact")) estimate_exact = atoi(argv[++i]);
+		else if (i < argc - 1 && !strcmp(argv[i], "--corpus")) corpus = atoi(argv[++i]);
+		else if (i < argc - 1 && !strcmp(argv[i], "--corpus-file")) corpus_path = argv[++i];
+		else if (i < argc - 1 && (!strcmp(argv[i], "--seed") || !strcmp(argv[i], "-s"))) seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--test") || !strcmp(argv[i], "-t")) {
+			if ((mperft = mperft_create(seed)) == NULL) exit(EXIT_FAILURE);
+			perft_test(mperft);
+			mperft_destroy(mperft);
+			return 0;
+		} else {
+			printf("%s <args> \n", argv[0]);
+			puts("Enumerate moves. The following options are available:");
+			puts("\t--help|-?            Print this message.");
+			puts("\t--fen|-f <fen>       Use the position indicated in FEN format (default=starting position).");
+			puts("\t--kiwipete|-k        Use the kiwipete position.");
+			puts("\t--depth|-d <depth>   Test up to this depth (default=6).");
+			puts("\t--bulk|-b            Do fast bulk counting at the last ply.");
+			puts("\t--hash|-h <size>     Use a hashtable with <size> Megabytes, or auto(matically) half the available memory (default 0, no hashtable).");
+			puts("\t--hash-shm <name>    Share the hashtable through the POSIX shared memory <name>.");
+			puts("\t--hash-policy <p>    Hash the low depths with the fixed rule (default) or an auto(matically) adapted policy.");
+			puts("\t--hash-verify        Check every hashtable match against the stored position & report the false matches.");
+			puts("\t--numa <policy>      Place the hashtable over the numa nodes: none, interleave or partition (one part per node, used by its --div threads).");
+			puts("\t--affinity <policy>  Pin the threads to the cpus: none, compact or scatter.");
+			puts("\t--numa-nodes <n>     Simulate a numa topology with <n> nodes.");
+			puts("\t--capture|-c         Generate only captures, promotions & check evasions.");
+			puts("\t--div                Print a node count for each move.");
+			puts("\t--threads|-j <n>     Search the root moves of --div with <n> threads (default: all the cpus).");
+			puts("\t--detailed           Count captures, en passant, castles, promotions, checks & checkmates.");
+			puts("\t--iterative          Use the non recursive perft engine.");
+			puts("\t--symmetry           Share the hashtable between color-flipped & mirrored positions.");
+			puts("\t--progress <seconds> Report the progress of the search every <seconds>, and on SIGUSR1.");
+			puts("\t--progress-file <f>  Also write the progress into the file <f> (default period: 10 s).");
+			puts("\t--estimate <seconds> Estimate the leaf count at <depth> by sampling random paths for about <seconds>.");
+			puts("\t--estimate-exact <d> Count exactly the last <d> plies of each sample (default: 4).");
+			puts("\t--unique             Count the distinct positions at <depth>, within the --hash size (default: 256 Mbytes).");
+			puts("\t--corpus <n>         Benchmark <n> positions per category (opening, middlegame, endgame, check) from seeded random games.");
+			puts("\t--corpus-file <f>    Save the corpus with its leaf counts into the EPD file <f>.");
+			puts("\t--seed|-s <seed>     Change the seed of the pseudo move generator to <seed>.");
+			puts("\t--loop|-l            Loop from depth 1 to <depth>.");
+			puts("\t--repeat|-r <n>      Repeat the test <n> time (default = 1).");
+			puts("\t--warm               Keep the hashtable entries between depths & repetitions (default).");
+			puts("\t--cold               Clear the hashtable before each depth & repetition.");
+			puts("\t--server             Serve perft commands read from the standard input.");
+			puts("\t--socket <path>      Serve perft commands read from a Unix socket.");
+			puts("\t--test|-t            Run an internal test to check the move generator.");
+			return 0;
+		}
+	}
+
+	// post-initialisation
+	if ((mperft = mperft_create(seed)) == NULL) exit(EXIT_FAILURE);
+	if (hash_size < 0) hash_size = hash_auto_size();
+	board_init(&board, mperft);
+	if (hash_name) {
+	#if defined(__unix__) || defined(__APPLE__)
+		if (hash_size <= 0 || detailed) {
+			fprintf(stderr, "Fatal Error: --hash-shm needs a --hash size and no --detailed statistics\n");
+			exit(EXIT_FAILURE);
+		}
+		if ((hashtable = hash_create_shared(hash_name, hash_size, seed, !capture)) == NULL) exit(EXIT_FAILURE);
+	#else
+		fprintf(stderr, "Fatal Error: --hash-shm is not available on this system\n");
+		exit(EXIT_FAILURE);
+	#endif
+	} else if (hash_size > 0 && !unique && (hashtable = hash_create(hash_size, detailed)) == NULL) exit(EXIT_FAILURE);
+	numa_init(&numa, numa_nodes);
+	numa_pin(&numa, 0);
+	if (hashtable && !hash_name) {
+		if (numa.policy == NUMA_NONE) hash_reset(hashtable);
+		else hash_place(hashtable, &numa);
+	}
+	if (detailed && (estimate > 0.0 || corpus > 0)) {
+		fprintf(stderr, "Fatal Error: --estimate & --corpus count no --detailed statistics\n");
+		exit(EXIT_FAILURE);
+	}
+	if (detailed + iterative + (progress > 0.0 || progress_path != NULL) + verify + symmetry > 1) {
+		fprintf(stderr, "Fatal Error: --detailed, --iterative, --progress, --hash-verify & --symmetry select distinct perft engines: choose one\n");
+		exit(EXIT_FAILURE);
+	}
+	if (div && (iterative || progress > 0.0 || progress_path != NULL)) {
+		fprintf(stderr, "Fatal Error: --div runs neither the --iterative nor the --progress engine\n");
+		exit(EXIT_FAILURE);
+	}
+	if (verify) {
+		if (hashtable == NULL || div) {
+			fprintf(stderr, "Fatal Error: --hash-verify needs a --hash size and no --div\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!hash_verify_create(hashtable)) exit(EXIT_FAILURE);
+	}
+	if (fen && !board_set(&board, mperft, fen)) exit(EXIT_FAILURE);
+	if (depth < 1) depth = 1;
+	if (depth > 64) depth = 64;
+	if (n_repetition < 1) n_repetition = 1;
+	if (progress_path && progress <= 0.0) progress = 10.0;
+#if defined(__unix__) || defined(__APPLE__)
+	if (progress > 0.0) signal(SIGUSR1, progress_signal);
+#endif
+
+	// server mode: keep the tables & the hashtable alive between requests
+	if (serve) {
+	#if defined(__unix__) || defined(__APPLE__)
+		if (socket_path) {
+			if (!server_socket(socket_path, mperft, &board, hashtable)) exit(EXIT_FAILURE);
+		} else server_run(stdin, stdout, mperft, &board, hashtable);
+	#else
+		server_run(stdin, stdout, mperft, &board, hashtable);
+	#endif
+		hash_destroy(hashtable);
+		mperft_destroy(mperft);
+		return 0;
+	}
+
+	printf("Perft setting: ");
+	if (hashtable == NULL) printf("no hashing; ");
+	else printf("%shashtable size: %u Mbytes (%llu entries); ", hash_name ? "shared " : "", (unsigned) (hash_bytes(hashtable) >> 20), (unsigned long long) hash_entries(hashtable));
+	if (detailed) printf("detailed statistics;");
+	else { if (bulk) printf("with"); else printf("no"); printf(" bulk counting;"); }
+	if (capture) printf(" capture only;");
+	puts("");
+	if (numa_report && hashtable) hash_numa_report(hashtable, &numa, stdout);
+	board_print(&board, stdout);
+	if (adapt && hashtable && !detailed && !verify) hash_adapt(hashtable, &board, depth, bulk, !capture, stdout);
+
+	// root search
+	if (unique) {
+		if (!perft_unique(&board, depth, hash_size > 0 ? hash_size : 256, !capture, &unique_count, stdout)) exit(EXIT_FAILURE);
+	} else if (corpus > 0) {
+		if (!perft_corpus(&board, hashtable, corpus, depth, bulk, !capture, seed, corpus_path, stdout)) exit(EXIT_FAILURE);
+	} else if (estimate > 0.0) {
+		perft_estimate(&board, hashtable, depth, estimate_exact >= 0 ? estimate_exact : 4, bulk, !capture, estimate, seed, stdout);
+	} else if (div) {
+		total_time = -mperft_chrono();
+		total = perft_div(&board, hashtable, &numa, depth, bulk, !capture, detailed, symmetry, n_threads, &total_stats, stdout);
+		total_time += mperft_chrono();
+	} else {
+		for (int r = 1; r <= n_repetition; ++r) {
+			for (int d = (loop ? 1 : depth); d <= depth; ++d) {
+				if (hashtable && cold) hash_clear(hashtable);
+				partial_time = -mperft_chrono();
+				if (detailed) {
+					stats = (Stats) {0};
+					perft_detailed(&board, hashtable, d, !capture, &stats);
+					count = stats.leaves;
+				} else if (iterative) {
+					if (search == NULL && (search = perft_search_create()) == NULL) exit(EXIT_FAILURE);
+					count = count_check(perft_iterative(search, &board, hashtable, d, bulk, !capture));
+				} else if (progress > 0.0) count = perft_progress(&board, hashtable, d, bulk, !capture, progress, progress_path, &PROGRESS_DUMP, stdout);
+				else if (verify) count = count_check(perft_verify(&board, hashtable, d, bulk, !capture));
+				else if (symmetry) count = count_check(perft_symmetry(&board, hashtable, d, bulk, !capture));
+				else count = perft_wide(&board, hashtable, d, bulk, !capture);
+				total += count;
+				partial_time += mperft_chrono();
+				total_time += partial_time;
+				printf("perft %2d : %15s leaves in %10.3f s %12.0f leaves/s\n", d, count_to_string(count, NULL), partial_time, (double) count / partial_time);
+				if (detailed) stats_print(&stats, stdout);
+			}
+		}
+	}
+	if (div || loop || n_repetition > 1) printf("total    : %15s leaves in %10.3f s %12.0f leaves/s\n", count_to_string(total, NULL), total_time, (double) total / total_time);
+	if (div && detailed) stats_print(&total_stats, stdout);
+	if (verify) hash_verify_report(hashtable, stdout);
+
+	hash_destroy(hashtable);
+	perft_search_destroy(search);
+	mperft_destroy(mperft);
+
+	full_time += mperft_chrono();
+	printf("full time: %10.3f s\n", full_time);
+
+	return 0;
+}
@@ -1,8 +1,7 @@
 /*
  * mperft.c
  *
- * perft using magic bitboard & transposition table.
- * TODO: add multithreading
+ * libmperft: perft using magic bitboard & transposition table.
  *
  * © 2020-2056 Richard Delorme
  * version 2.0
@@ -10,7 +9,12 @@
 
 /* Includes */
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdalign.h>
 #include <stdbool.h>
+#include <stdckdint.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -19,9 +23,22 @@
 
 #if defined(__unix__) || defined(__APPLE__)
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <pthread.h>
 #endif
 
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "mperft.h"
+
 #if defined(_WIN32)
 	#include <intrin.h>
 #elif defined(__x86_64__)
@@ -53,20 +70,10 @@
 	#include <stdbit.h>
 #endif
 
-/* fast PEXT availability */
-#if (defined(__BMI2__) && !defined(__znver1__) && !defined(__znver2__))
-	#define HAS_PEXT 1
-#endif
 
 /* Types */
-typedef enum {GAME_SIZE = 4096, MOVE_SIZE = 256} Limits;
-
-typedef uint64_t Bitboard;
-
 typedef uint64_t Random;
 
-typedef enum { WHITE, BLACK, COLOR_SIZE } Color;
-
 typedef enum
 {
 	A1, B1, C1, D1, E1, F1, G1, H1,
@@ -80,18 +87,30 @@ typedef enum
 	BOARD_SIZE, ENPASSANT_NONE = BOARD_SIZE, BOARD_OUT = -1
 } Square;
 
-typedef enum { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING, PIECE_SIZE } Piece;
-
 typedef enum { EMPTY, WPAWN, BPAWN, WKNIGHT, BKNIGHT, WBISHOP, BBISHOP, WROOK, BROOK, WQUEEN, BQUEEN, WKING, BKING, CPIECE_SIZE } CPiece;
 
 typedef enum { KNIGHT_PROMOTION = 0x1000, BISHOP_PROMOTION = 0x2000, ROOK_PROMOTION = 0x3000, QUEEN_PROMOTION = 0x4000 } Promotion;
 
-typedef uint16_t Move;
+typedef enum { SYMMETRY_NONE, SYMMETRY_FLIP, SYMMETRY_MIRROR, SYMMETRY_FLIP_MIRROR, SYMMETRY_SIZE } Symmetry;
 
-typedef struct Key {
-	uint64_t code;
-	uint32_t index;
-} Key;
+typedef enum { HASH_OFF, HASH_MAIN, HASH_SMALL, HASH_MODE_SIZE } HashMode;
+
+typedef enum { COUNT_SET_SIZE = 64 } CountLimits;
+
+typedef enum { BATCH_SIZE = 8 } BatchLimits;
+
+struct KeyTable {
+	Key player[COLOR_SIZE];
+	Key square[BOARD_SIZE][CPIECE_SIZE];
+	Key castling[16];
+	Key enpassant[BOARD_SIZE + 1];
+	Key play;
+};
+
+struct MPerft {
+	KeyTable key[SYMMETRY_SIZE];
+	uint64_t seed;
+};
 
 typedef struct Attack {
 	Bitboard mask;
@@ -100,21 +119,25 @@ typedef struct Attack {
 	Bitboard *attack;
 } Attack;
 
+/* Per square lookups used at every node, on two cache lines: the slider attacks, then the other pieces */
 typedef struct Mask {
-	Bitboard between[BOARD_SIZE];
-	int direction[BOARD_SIZE];
+	alignas(64) Attack bishop;
+	Attack rook;
+	Bitboard knight;
+	Bitboard king;
+	Bitboard pawn_attack[COLOR_SIZE];
+	Bitboard enpassant;
+	Bitboard bishop_lines;
+	Bitboard rook_lines;
+} Mask;
+
+/* Per square lines, for the moves of the pinned pieces */
+typedef struct Line {
 	Bitboard diagonal;
 	Bitboard antidiagonal;
 	Bitboard file;
 	Bitboard rank;
-	Bitboard pawn_attack[COLOR_SIZE];
-	Bitboard pawn_push[COLOR_SIZE];
-	Bitboard enpassant;
-	Bitboard knight;
-	Bitboard king;
-	Attack bishop;
-	Attack rook;
-} Mask;
+} Line;
 
 typedef struct BoardStack {
 	Bitboard pinned;
@@ -125,20 +148,6 @@ typedef struct BoardStack {
 	uint8_t victim;
 } BoardStack;
 
-typedef struct Board {
-	Bitboard piece[PIECE_SIZE];
-	Bitboard color[COLOR_SIZE];
-	Bitboard pinned;
-	Bitboard checkers;
-	uint8_t cpiece[BOARD_SIZE];
-	Square x_king[COLOR_SIZE];
-	Key key;
-	int ply;
-	Color player;
-	uint8_t castling;
-	uint8_t enpassant;
-} Board;
-
 typedef struct MoveArray {
 	Move move[MOVE_SIZE];
 	int n;
@@ -151,21 +160,77 @@ typedef struct {
 } Hash;
 
 typedef struct {
+	uint64_t code;
+	uint64_t depth;
+	Stats stats;
+} StatsHash;
+
+typedef struct CheckInfo {
+	Bitboard check[PIECE_SIZE];
+	Bitboard discover;
+	Bitboard bq;
+	Bitboard rq;
+	Square king;
+} CheckInfo;
+
+typedef struct {
+	uint64_t code;
+	uint64_t depth;
+	Count count;
+} WideHash;
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t seed;
+	uint64_t entries;
+	uint8_t do_quiet;
+	uint8_t padding[31];
+} HashHeader;
+
+typedef struct Position {
+	Bitboard piece[PIECE_SIZE];
+	Bitboard color[COLOR_SIZE];
+	uint8_t player;
+	uint8_t castling;
+	uint8_t enpassant;
+} Position;
+
+typedef struct HashVerify {
+	Position *position;
+	uint64_t probes;
+	uint64_t hits;
+	uint64_t candidates;
+	uint64_t collisions[65];
+} HashVerify;
+
+struct HashTable {
 	Hash *hash;
-	uint64_t mask;
-} HashTable;
+	StatsHash *stats;
+	HashHeader *header;
+	WideHash *wide;
+	HashVerify *verify;
+	Hash *small;
+	uint64_t small_mask;
+	uint64_t size;
+	uint64_t generation;
+	uint8_t policy[PLY_SIZE];
+	int key_depth;
+	bool do_quiet;
+};
 
 /* Constants */
-const Bitboard RANK[] =  {
+static const Bitboard RANK[] =  {
 	0x00000000000000ffULL, 0x000000000000ff00ULL, 0x0000000000ff0000ULL, 0x00000000ff000000ULL,
 	0x000000ff00000000ULL, 0x0000ff0000000000ULL, 0x00ff000000000000ULL, 0xff00000000000000ULL,
 };
-const Bitboard COLUMN[] = {
+static const Bitboard COLUMN[] = {
 	0x0101010101010101ULL, 0x0202020202020202ULL, 0x0404040404040404ULL, 0x0808080808080808ULL,
 	0x1010101010101010ULL, 0x2020202020202020ULL, 0x4040404040404040ULL, 0x8080808080808080ULL,
 };
-const int PUSH[] = {8, -8};
-const uint8_t MASK_CASTLING[BOARD_SIZE] = {
+static const int PUSH[] = {8, -8};
+static const uint8_t MASK_CASTLING[BOARD_SIZE] = {
 	13,15,15,15,12,15,15,14,
 	15,15,15,15,15,15,15,15,
 	15,15,15,15,15,15,15,15,
@@ -175,22 +240,27 @@ const uint8_t MASK_CASTLING[BOARD_SIZE] = {
 	15,15,15,15,15,15,15,15,
 	 7,15,15,15, 3,15,15,11
 };
-const int CAN_CASTLE_KINGSIDE[COLOR_SIZE] = {1, 4};
-const int CAN_CASTLE_QUEENSIDE[COLOR_SIZE] = {2, 8};
-const Bitboard PROMOTION_RANK[] = {0xff00000000000000ULL, 0x00000000000000ffULL};
-const Random MASK48 = 0xFFFFFFFFFFFFull;
-const int BUCKET_SIZE = 4;
+static const int CAN_CASTLE_KINGSIDE[COLOR_SIZE] = {1, 4};
+static const int CAN_CASTLE_QUEENSIDE[COLOR_SIZE] = {2, 8};
+static const Bitboard PROMOTION_RANK[] = {0xff00000000000000ULL, 0x00000000000000ffULL};
+static const Random MASK48 = 0xFFFFFFFFFFFFull;
+static const int BUCKET_SIZE = 4;
+static const int WIDE_DEPTH = 11;
+static const int WIDE_HASH_SIZE = 1 << 16;
+static const int SMALL_HASH_SIZE = 1 << 16;
+static const uint64_t NARROW_COUNT_MAX = (1ull << 58) - 1;
+static const char HASH_MAGIC[8] = "MPERFT#";
+static const uint32_t HASH_VERSION = 3;
+static const uint64_t GENERATION_MASK = 0xff;
 
 /* Globals */
-Mask MASK[BOARD_SIZE];
-Key KEY_PLAYER[COLOR_SIZE];
-Key KEY_SQUARE[BOARD_SIZE][CPIECE_SIZE];
-Key KEY_CASTLING[16];
-Key KEY_ENPASSANT[BOARD_SIZE + 1];
-Key KEY_PLAY;
+static Mask MASK[BOARD_SIZE];
+static Line LINE[BOARD_SIZE];
+static Bitboard BETWEEN[BOARD_SIZE][BOARD_SIZE];
+static int8_t DIRECTION[BOARD_SIZE][BOARD_SIZE];
 
 /* Byte swap (= vertical mirror) */
-Bitboard bit_bswap(Bitboard b) {
+static inline Bitboard bit_bswap(Bitboard b) {
 #if defined(_MSC_VER)
 	return _byteswap_uint64(b);
 #elif defined(__POCC__)
@@ -206,7 +276,7 @@ Bitboard bit_bswap(Bitboard b) {
 }
 
 /* Time in seconds */
-double chrono(void) {
+double mperft_chrono(void) {
 	#if defined(__unix__) || defined(__APPLE__)
 		#if _POSIX_TIMERS > 0
 			struct timespec t;
@@ -223,14 +293,13 @@ double chrono(void) {
 	#endif
 }
 
-/* Memory error */
-void memory_error(const char *function) {
-	fprintf(stderr, "Fatal Error: memory allocation failure in %s\n", function);
-	exit(EXIT_FAILURE);
+/* Memory error: reported, then returned to the caller */
+static void memory_error(const char *function) {
+	fprintf(stderr, "Error: memory allocation failure in %s\n", function);
 }
 
 /* Parse error. */
-void parse_error(const char *string, const char *done, const char *msg) {
+static bool parse_error(const char *string, const char *done, const char *msg) {
 	size_t n;
 
 	fprintf(stderr, "\nError in %s '%s'\n", msg, string);
@@ -239,17 +308,27 @@ void parse_error(const char *string, const char *done, const char *msg) {
 		while (n--) putc('-', stderr);
 		putc('^', stderr); putc('\n', stderr); putc('\n', stderr);
 	}
-	exit(EXIT_FAILURE);
+	return false;
 }
 
 /* Skip spaces */
-char *parse_next(const char *s) {
+static char *parse_next(const char *s) {
 	while (isspace((int)*s)) ++s;
 	return (char*) s;
 }
 
+/* Get the next word & skip it */
+static char *parse_word(char **s) {
+	char *word = parse_next(*s);
+
+	if (*word == '\0') return NULL;
+	for (*s = word; **s && !isspace((int)**s); ++*s) ;
+	if (**s) *(*s)++ = '\0';
+	return word;
+}
+
 /* Get a random number */
-uint64_t random_get(Random *random) {
+static uint64_t random_get(Random *random) {
 	const uint64_t A = 0x5deece66dull;
 	const uint64_t B = 0xbull;
 	register uint64_t r;
@@ -261,7 +340,7 @@ uint64_t random_get(Random *random) {
 }
 
 /* Init the random generator */
-void random_seed(Random *random, const uint64_t seed) {
+static void random_seed(Random *random, const uint64_t seed) {
 	*random = (seed & MASK48);
 }
 
@@ -402,8 +481,8 @@ static inline Piece move_promotion(const Move move) {
 }
 
 /* Convert a move to a string */
-static inline char* move_to_string(const Move move, char *s) {
-	static char string[8];
+char* move_to_string(const Move move, char *s) {
+	static _Thread_local char string[8];
 
 	if (s == NULL) s = string;
 	if (move) {
@@ -454,10 +533,24 @@ static inline Bitboard king_attack(const Square x, const Bitboard target) {
 	return MASK[x].king & target;
 }
 
+/* Get the piece type on an occupied square */
+static inline Piece board_piece(const Board *board, const Square x) {
+	return ((board->piece[KNIGHT] >> x) & 1) * KNIGHT + ((board->piece[BISHOP] >> x) & 1) * BISHOP + ((board->piece[ROOK] >> x) & 1) * ROOK
+	     + ((board->piece[QUEEN] >> x) & 1) * QUEEN + ((board->piece[KING] >> x) & 1) * KING;
+}
+
+/* Get the colored piece on a square (or EMPTY) */
+static inline CPiece board_cpiece(const Board *board, const Square x) {
+	const Bitboard b = square_to_bit(x);
+
+	if ((board->color[WHITE] | board->color[BLACK]) & b) return cpiece_make(board_piece(board, x), (board->color[BLACK] & b) != 0);
+	else return EMPTY;
+}
+
 /* Init key to a random value */
 static inline void key_init(Key *key, Random *r) {
 	key->code = random_get(r);
-	key->index = (uint32_t) random_get(r);
+	key->index = random_get(r);
 }
 
 /* Xor a key with another one */
@@ -466,67 +559,84 @@ static inline void key_xor(Key *key, const Key *k) {
 	key->index ^= k->index;
 }
 
-/* Set a key from a board */
-void key_set(Key *key, const Board *board) {
-	int x;
-
-	*key = KEY_PLAYER[board->player];
-	foreach_square (x) {
-		key_xor(key, &KEY_SQUARE[x][board->cpiece[x]]);
+/* Set the key of a board, as seen through a symmetry */
+static void key_set_symmetry(Key *key, const Board *board, const Symmetry s) {
+	const KeyTable *t = board->keys + s;
+	Bitboard b;
+	Piece p;
+	Color c;
+
+	*key = t->player[board->player];
+	foreach_color (c)
+	for (p = PAWN; p < PIECE_SIZE; ++p) {
+		b = board->piece[p] & board->color[c];
+		while (b) key_xor(key, &t->square[square_next(&b)][cpiece_make(p, c)]);
 	}
-	key_xor(key, &KEY_CASTLING[board->castling]);
-	key_xor(key, &KEY_ENPASSANT[board->enpassant]);
+	key_xor(key, &t->castling[board->castling]);
+	key_xor(key, &t->enpassant[board->enpassant]);
 }
 
-/* Update the key after a move is made */
-void key_update(Key *key, const Board *board, const Move move) {
-	const Square from = move_from(move);
-	const Square to = move_to(move);
-	CPiece cp = board->cpiece[from];
-	Piece p = cpiece_piece(cp);
-	const Color c = cpiece_color(cp);
-	const CPiece victim = board->cpiece[to];
+/* Set a key from a board */
+static void key_set(Key *key, const Board *board) {
+	key_set_symmetry(key, board, SYMMETRY_NONE);
+}
+
+/* Update a key, seen through the symmetry table t, after a move, whose piece & promotion are known, is made */
+static inline void key_make_symmetry(Key *key, const Key *base, const KeyTable *t, const Board *board, const Square from, const Square to, Piece p, const Piece promotion) {
+	const Color c = board->player;
+	CPiece cp = cpiece_make(p, c);
+	const CPiece victim = board_cpiece(board, to);
 	Square x, enpassant = ENPASSANT_NONE;
 
-	*key = board->key;
+	*key = *base;
 
 	// move the piece
-	key_xor(key, &KEY_SQUARE[from][cp]);
-	key_xor(key, &KEY_SQUARE[to][cp]);
+	key_xor(key, &t->square[from][cp]);
+	key_xor(key, &t->square[to][cp]);
 	// capture
-	if (victim) key_xor(key, &KEY_SQUARE[to][victim]);
+	if (victim) key_xor(key, &t->square[to][victim]);
 	// pawn move
 	if (p == PAWN) {
-		if ((p = move_promotion(move))) {
-			key_xor(key, &KEY_SQUARE[to][cp]);
-			key_xor(key, &KEY_SQUARE[to][cpiece_make(p, c)]);
+		if (promotion) {
+			key_xor(key, &t->square[to][cp]);
+			key_xor(key, &t->square[to][cpiece_make(promotion, c)]);
 		} else if (board->enpassant == to) {
 			x = square(file(to), rank(from));
-			key_xor(key, &KEY_SQUARE[x][cpiece_make(PAWN, opponent(c))]);
+			key_xor(key, &t->square[x][cpiece_make(PAWN, opponent(c))]);
 		} else if (abs(to - from) == 16 && (MASK[to].enpassant & (board->color[opponent(c)] & board->piece[PAWN]))) enpassant = (from + to) / 2;
 	// castling
 	} else if (p == KING) {
 		if (to == from + 2) {
-			cp = board->cpiece[from + 3];
-			key_xor(key, &KEY_SQUARE[from + 3][cp]);
-			key_xor(key, &KEY_SQUARE[from + 1][cp]);
+			cp = cpiece_make(ROOK, c);
+			key_xor(key, &t->square[from + 3][cp]);
+			key_xor(key, &t->square[from + 1][cp]);
 		} else if (to == from - 2) {
-			cp = board->cpiece[from - 4];
-			key_xor(key, &KEY_SQUARE[from - 4][cp]);
-			key_xor(key, &KEY_SQUARE[from - 1][cp]);
+			cp = cpiece_make(ROOK, c);
+			key_xor(key, &t->square[from - 4][cp]);
+			key_xor(key, &t->square[from - 1][cp]);
 		}
 	}
 	// miscellaneous
-	key_xor(key, &KEY_CASTLING[board->castling]);
-	key_xor(key, &KEY_CASTLING[board->castling & MASK_CASTLING[from] & MASK_CASTLING[to]]);
-	key_xor(key, &KEY_ENPASSANT[board->enpassant]);
-	key_xor(key, &KEY_ENPASSANT[enpassant]);
-	key_xor(key, &KEY_PLAY);
+	key_xor(key, &t->castling[board->castling]);
+	key_xor(key, &t->castling[board->castling & MASK_CASTLING[from] & MASK_CASTLING[to]]);
+	key_xor(key, &t->enpassant[board->enpassant]);
+	key_xor(key, &t->enpassant[enpassant]);
+	key_xor(key, &t->play);
+}
+
+/* Update the key after a move, whose piece & promotion are known, is made */
+static inline void key_make(Key *key, const Board *board, const Square from, const Square to, Piece p, const Piece promotion) {
+	key_make_symmetry(key, &board->key, board->keys, board, from, to, p, promotion);
+}
+
+/* Update the key after a move is made */
+static void key_update(Key *key, const Board *board, const Move move) {
+	key_make(key, board, move_from(move), move_to(move), board_piece(board, move_from(move)), move_promotion(move));
 }
 
 
 /* compute slider attack to feed array accessed by magic index */
-Bitboard compute_slider_attack(const int x, const Bitboard pieces, const int d[4][2]) {
+static Bitboard compute_slider_attack(const int x, const Bitboard pieces, const int d[4][2]) {
 	Bitboard a = 0, b;
 	int i, r, f;
 
@@ -541,15 +651,14 @@ Bitboard compute_slider_attack(const int x, const Bitboard pieces, const int d[4
 	return a;
 }
 
-/* Initialize some global constants */
-void init(const uint64_t seed) {
+/* Initialize the masks & attack tables, shared by all the contexts & never modified afterwards */
+static void mask_init(void) {
 	Bitboard o, inside;
-	int r, f, i, j, c;
+	int r, f, i, j;
 	int x, y, z;
 	static int d[64][64];
 	Mask *mask;
-	Random random[1];
-	CPiece p;
+	Line *line;
 	static const Bitboard rook_magic[BOARD_SIZE] = {
 		0x808000645080c000, 0x208020001480c000, 0x4180100160008048, 0x8180100018001680, 0x4200082010040201, 0x8300220400010008, 0x3100120000890004, 0x4080004500012180,
 		0x01548000a1804008, 0x4881004005208900, 0x0480802000801008, 0x02e8808010008800, 0x08cd804800240080, 0x8a058002008c0080, 0x0514000c480a1001, 0x0101000282004d00,
@@ -579,13 +688,19 @@ void init(const uint64_t seed) {
 
 	// MASK initialisations
 	MASK->bishop.attack = aligned_alloc(64, sizeof (Bitboard) * 0x1480);
-	if (MASK->bishop.attack == NULL) memory_error(__func__);
 	MASK->rook.attack = aligned_alloc(64, sizeof (Bitboard) * 0x19000);
-	if (MASK->rook.attack == NULL) memory_error(__func__);
+	if (MASK->bishop.attack == NULL || MASK->rook.attack == NULL) {
+		memory_error(__func__);
+		free(MASK->bishop.attack);
+		free(MASK->rook.attack);
+		MASK->bishop.attack = MASK->rook.attack = NULL;
+		return;
+	}
 	for (x = 0; x < 64; ++x) {
 		f = file(x);
 		r = rank(x);
 		mask = MASK + x;
+		line = LINE + x;
 
 		for (y = 0; y < 64; ++y) d[x][y] = 0;
 		// directions & between
@@ -594,27 +709,27 @@ void init(const uint64_t seed) {
 				y = square_safe(f + king_dir[i][0] * j, r + king_dir[i][1] * j);
 				if (y != BOARD_OUT) {
 					d[x][y] = king_dir[i][0] + 8 * king_dir[i][1];
-					mask->direction[y] = abs(d[x][y]);
-					for (z = x + d[x][y]; z != y; z += d[x][y]) mask->between[y] |= square_to_bit(z);
+					DIRECTION[x][y] = abs(d[x][y]);
+					for (z = x + d[x][y]; z != y; z += d[x][y]) BETWEEN[x][y] |= square_to_bit(z);
 				}
 			}
 		}
 
 		// diagonal / antidiagonal / rank / file
-		for (y = x - 9; y >= 0 && d[x][y] == -9; y -= 9) mask->diagonal |= square_to_bit(y);
-		for (y = x + 9; y < 64 && d[x][y] == 9; y += 9) mask->diagonal |= square_to_bit(y);
-		for (y = x - 7; y >= 0 && d[x][y] == -7; y -= 7) mask->antidiagonal |= square_to_bit(y);
-		for (y = x + 7; y < 64 && d[x][y] == 7; y += 7) mask->antidiagonal |= square_to_bit(y);
-		mask->file = (COLUMN[f] ^ square_to_bit(x));
-		mask->rank = (RANK[r] ^ square_to_bit(x));
+		for (y = x - 9; y >= 0 && d[x][y] == -9; y -= 9) line->diagonal |= square_to_bit(y);
+		for (y = x + 9; y < 64 && d[x][y] == 9; y += 9) line->diagonal |= square_to_bit(y);
+		for (y = x - 7; y >= 0 && d[x][y] == -7; y -= 7) line->antidiagonal |= square_to_bit(y);
+		for (y = x + 7; y < 64 && d[x][y] == 7; y += 7) line->antidiagonal |= square_to_bit(y);
+		line->file = (COLUMN[f] ^ square_to_bit(x));
+		line->rank = (RANK[r] ^ square_to_bit(x));
+		mask->bishop_lines = line->diagonal | line->antidiagonal;
+		mask->rook_lines = line->rank | line->file;
 
 		// pawns
 		for (i = 0; i < 2; ++i) {
 			mask->pawn_attack[WHITE] |= file_rank_to_bit(f + pawn_dir[i][0], r + pawn_dir[i][1]);
 			mask->pawn_attack[BLACK] |= file_rank_to_bit(f - pawn_dir[i][0], r - pawn_dir[i][1]);
 		}
-		mask->pawn_push[WHITE] |= file_rank_to_bit(f - 1, r);
-		mask->pawn_push[BLACK] |= file_rank_to_bit(f + 1, r);
 		if (r == 3 || r == 4) {
 			if (f > 0) mask->enpassant |= square_to_bit(x - 1);
 			if (f < 7) mask->enpassant |= square_to_bit(x + 1);
@@ -630,7 +745,7 @@ void init(const uint64_t seed) {
 		inside = ~(((RANK[0] | RANK[7]) & ~RANK[r]) | ((COLUMN[0] | COLUMN[7]) & ~COLUMN[f]));
 
 		//magic bishop
-		mask->bishop.mask = (mask->diagonal | mask->antidiagonal) & inside;
+		mask->bishop.mask = mask->bishop_lines & inside;
 		mask->bishop.shift = 64 - stdc_count_ones_ull(mask->bishop.mask);
 		mask->bishop.magic = bishop_magic[x];
 		if (x) mask->bishop.attack = mask[-1].bishop.attack + (1u << stdc_count_ones_ull(mask[-1].bishop.mask));
@@ -640,7 +755,7 @@ void init(const uint64_t seed) {
 		} while (o);
 
 		// magic rook
-		mask->rook.mask = (mask->rank | mask->file) & inside;
+		mask->rook.mask = mask->rook_lines & inside;
 		mask->rook.shift = 64 - stdc_count_ones_ull(mask->rook.mask);
 		mask->rook.magic = rook_magic[x];
 		if (x) mask->rook.attack = mask[-1].rook.attack + (1u << stdc_count_ones_ull(mask[-1].rook.mask));
@@ -650,22 +765,74 @@ void init(const uint64_t seed) {
 		} while (o);
 	}
 
-	// Hash key
+}
+
+/* Initialize the hash keys, including those seen through each symmetry */
+static void key_table_init(KeyTable *key, const uint64_t seed) {
+	Random random[1];
+	int c, x;
+	CPiece p;
+	Symmetry s;
+
 	random_seed(random, seed);
 
-	foreach_color (c) key_init(KEY_PLAYER + c, random);
+	foreach_color (c) key_init(key->player + c, random);
 
-	KEY_PLAY = KEY_PLAYER[WHITE];
-	key_xor(&KEY_PLAY, &KEY_PLAYER[BLACK]);
+	key->play = key->player[WHITE];
+	key_xor(&key->play, &key->player[BLACK]);
 
 	foreach_square (x)
 	foreach_cpiece (p)
-		key_init(&KEY_SQUARE[x][p], random);
+		key_init(&key->square[x][p], random);
+
+	for (c = 1; c < 16; ++c) key_init(key->castling + c, random);
+
+	foreach_square (x) key_init(key->enpassant + x, random);
+	key_init(key->enpassant + BOARD_SIZE, random);
+
+	// Symmetric keys: the key of the color-flipped (x ^ 56) and/or left-right mirrored (x ^ 7) position
+	for (s = SYMMETRY_FLIP; s < SYMMETRY_SIZE; ++s) {
+		const int t = (s & SYMMETRY_FLIP ? 56 : 0) ^ (s & SYMMETRY_MIRROR ? 7 : 0);
+		KeyTable *k = key + s;
+		foreach_color (c) k->player[c] = key->player[c ^ (s & SYMMETRY_FLIP)];
+		k->play = key->play;
+		foreach_square (x) {
+			k->square[x][EMPTY] = key->square[x ^ t][EMPTY];
+			foreach_cpiece (p) k->square[x][p] = key->square[x ^ t][s & SYMMETRY_FLIP ? ((p - 1) ^ 1) + 1 : p];
+			k->enpassant[x] = key->enpassant[x ^ t];
+		}
+		k->enpassant[BOARD_SIZE] = key->enpassant[BOARD_SIZE];
+		for (c = 0; c < 16; ++c) k->castling[c] = key->castling[s & SYMMETRY_FLIP ? (c >> 2) | ((c & 3) << 2) : c];
+	}
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+static pthread_once_t MASK_ONCE = PTHREAD_ONCE_INIT;
+#endif
+
+/* Create a context: the masks are initialized on first use, then the hash keys from the seed. NULL on failure. */
+MPerft* mperft_create(const uint64_t seed) {
+	MPerft *mperft = malloc(sizeof (MPerft));
 
-	for (c = 1; c < 16; ++c) key_init(KEY_CASTLING + c, random);
+#if defined(__unix__) || defined(__APPLE__)
+	pthread_once(&MASK_ONCE, mask_init);
+#else
+	if (MASK->rook.attack == NULL) mask_init();
+#endif
+	if (mperft == NULL || MASK->rook.attack == NULL) {
+		memory_error(__func__);
+		free(mperft);
+		return NULL;
+	}
+	key_table_init(mperft->key, seed);
+	mperft->seed = seed;
 
-	foreach_square (x) key_init(KEY_ENPASSANT + x, random);
-	key_init(KEY_ENPASSANT + BOARD_SIZE, random);
+	return mperft;
+}
+
+/* Destroy a context */
+void mperft_destroy(MPerft *mperft) {
+	free(mperft);
 }
 
 /* check if an enpassant move is possible */
@@ -674,20 +841,16 @@ static inline bool board_enpassant(const Board *board) {
 }
 
 /* deplace a piece on the board */
-static inline void board_deplace_piece(Board *board, const Square from, const Square to) {
+static inline void board_deplace_piece(Board *board, const Square from, const Square to, const Piece p, const Color c) {
 	const Bitboard b = square_to_bit(from) ^ square_to_bit(to);
-	const CPiece cp = board->cpiece[from];
-	const Piece p = cpiece_piece(cp);
-	const Color c = cpiece_color(cp);
 
 	board->piece[p] ^= b;
 	board->color[c] ^= b;
-	board->cpiece[to] = cp;
-	board->cpiece[from] = EMPTY;
 }
 
-/* generate checker & pinned pieces */
-void generate_checkers(Board *board) {
+/* Slider checkers & pinned pieces: the bishop or rook scans from the king, run only if an enemy slider of that kind
+ * stands on the matching lines of the king */
+static inline void generate_slider_checkers(Board *board) {
 	const Color c = board->player;
 	const Color o = opponent(c);
 	const Square k = board->x_king[c];
@@ -700,46 +863,67 @@ void generate_checkers(Board *board) {
 	Bitboard *checkers = &board->checkers;
 	Square x;
 
-	*pinned = 0;
+	*pinned = *checkers = 0;
 
-	// bishop or queen: all square reachable from the king square.
-	b = bishop_attack(pieces, k, -1ull);
+	// bishop or queen, if any on the diagonals of the king: all square reachable from the king square.
+	if (bq & MASK[k].bishop_lines) {
+		b = bishop_attack(pieces, k, -1ull);
 
-	//checkers
-	*checkers = partial_checkers = b & bq;
+		//checkers
+		*checkers = partial_checkers = b & bq;
 
-	// pinned square
-	b &= board->color[c];
-	if (b) {
-		b = bishop_attack(pieces ^ b, k, bq ^ partial_checkers);
-		while (b) {
-			x = square_next(&b);
-			*pinned |= MASK[x].between[k] & board->color[c];
+		// pinned square
+		b &= board->color[c];
+		if (b) {
+			b = bishop_attack(pieces ^ b, k, bq ^ partial_checkers);
+			while (b) {
+				x = square_next(&b);
+				*pinned |= BETWEEN[x][k] & board->color[c];
+			}
 		}
 	}
 
-	// rook or queen: all square reachable from the king square.
-	b = rook_attack(pieces, k, -1ull);
+	// rook or queen, if any on the lines of the king: all square reachable from the king square.
+	if (rq & MASK[k].rook_lines) {
+		b = rook_attack(pieces, k, -1ull);
 
-	// checkers = opponent rook or queen
-	*checkers |= partial_checkers = b & rq;
+		// checkers = opponent rook or queen
+		*checkers |= partial_checkers = b & rq;
 
-	// pinned square
-	b &= board->color[c];
-	if (b) {
-		b = rook_attack(pieces ^ b, k, rq ^ partial_checkers);
-		while (b) {
-			x = square_next(&b);
-			*pinned |= MASK[x].between[k] & board->color[c];
+		// pinned square
+		b &= board->color[c];
+		if (b) {
+			b = rook_attack(pieces ^ b, k, rq ^ partial_checkers);
+			while (b) {
+				x = square_next(&b);
+				*pinned |= BETWEEN[x][k] & board->color[c];
+			}
 		}
 	}
+}
+
+/* generate checker & pinned pieces */
+static void generate_checkers(Board *board) {
+	const Color c = board->player;
+	const Square k = board->x_king[c];
+
+	generate_slider_checkers(board);
 
 	// other pieces (no more pins)
-	*checkers |= knight_attack(k, board->piece[KNIGHT]);
-	*checkers |= pawn_attack(k, c, board->piece[PAWN]);
-	*checkers &= board->color[o];
+	board->checkers |= (knight_attack(k, board->piece[KNIGHT]) | pawn_attack(k, c, board->piece[PAWN])) & board->color[opponent(c)];
+}
+
+/* Checkers & pinned pieces of a board just played with a move of the piece <p> (promoted if so) to <to>: a
+ * knight or a pawn can only give a check by moving, so only the moved one is looked for besides the sliders */
+static void generate_checkers_move(Board *board, const Square to, const Piece p) {
+	const Color c = board->player;
+	const Square k = board->x_king[c];
+
+	generate_slider_checkers(board);
 
-	return;
+	// knight or pawn: the moved piece only
+	if (p == KNIGHT) board->checkers |= knight_attack(k, square_to_bit(to));
+	else if (p == PAWN) board->checkers |= pawn_attack(k, c, square_to_bit(to));
 }
 
 /* Clear the board. Set all of its content to zeroes. */
@@ -748,20 +932,9 @@ static inline void board_clear(Board *board) {
 }
 
 /* Initialize the board to the starting position. */
-void board_init(Board *board) {
-	static const uint8_t cpiece[BOARD_SIZE] = {
-		WROOK, WKNIGHT, WBISHOP, WQUEEN, WKING, WBISHOP, WKNIGHT, WROOK,
-		WPAWN,WPAWN,WPAWN,WPAWN,WPAWN,WPAWN,WPAWN,WPAWN,
-		EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,
-		EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,
-		EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,
-		EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,EMPTY,
-		BPAWN,BPAWN,BPAWN,BPAWN,BPAWN,BPAWN,BPAWN,BPAWN,
-		BROOK, BKNIGHT, BBISHOP, BQUEEN, BKING, BBISHOP, BKNIGHT, BROOK
-	};
-
+void board_init(Board *board, const MPerft *mperft) {
 	board_clear(board);
-	memcpy(board->cpiece, cpiece, BOARD_SIZE);
+	board->keys = mperft->key;
 	board->piece[PAWN] =   0x00ff00000000ff00ull;
 	board->piece[KNIGHT] = 0x4200000000000042ull;
 	board->piece[BISHOP] = 0x2400000000000024ull;
@@ -782,29 +955,30 @@ void board_init(Board *board) {
 }
 
 /* parse a FEN board description */
-void board_set(Board *board, char *string) {
+bool board_set(Board *board, const MPerft *mperft, char *string) {
 	char *s = string;
 	Square x;
 	int r, f;
 	CPiece p;
 
-	if (!s || *s == '\0') return;
+	if (!s || *s == '\0') return false;
 	board_clear(board);
+	board->keys = mperft->key;
 	// board
 	r = 7, f = 0;
 	do {
 		if (*s == '/') {
-			if (r <= 0) parse_error(string, s, "FEN: too many ranks");
-			if (f != 8) parse_error(string, s, "FEN: missing square");
+			if (r <= 0) return parse_error(string, s, "FEN: too many ranks");
+			if (f != 8) return parse_error(string, s, "FEN: missing square");
 			f = 0; r--;
 		} else if (isdigit((int)*s)) {
 			f += (Square) (*s - '0');
-			if (f > 8) parse_error(string, s, "FEN: file overflow");
+			if (f > 8) return parse_error(string, s, "FEN: file overflow");
 		} else {
-			if (f > 8) parse_error(string, s, "FEN: file overflow");
+			if (f >= 8) return parse_error(string, s, "FEN: file overflow");
 			x = square(f, r);
-			board->cpiece[x] = p = cpiece_from_char(*s);
-			if (board->cpiece[x] == CPIECE_SIZE) parse_error(string, s, "FEN: bad piece");
+			p = cpiece_from_char(*s);
+			if (p == CPIECE_SIZE) return parse_error(string, s, "FEN: bad piece");
 			board->piece[cpiece_piece(p)] |= square_to_bit(x);
 			board->color[cpiece_color(p)] |= square_to_bit(x);
 			if (cpiece_piece(p) == KING) board->x_king[cpiece_color(p)] = x;
@@ -812,11 +986,11 @@ void board_set(Board *board, char *string) {
 		}
 		++s;
 	} while (*s && *s != ' ');
-	if (r < 0 || f != 8) parse_error(string, s, "FEN: missing square");
+	if (r < 0 || f != 8) return parse_error(string, s, "FEN: missing square");
 	// turn
-	if (*s++ != ' ') parse_error(string, s, "FEN: missing space before player's turn");
+	if (*s++ != ' ') return parse_error(string, s, "FEN: missing space before player's turn");
 	board->player = (uint8_t) color_from_char(*s);
-	if (board->player == COLOR_SIZE) parse_error(string, s, "FEN: bad player's turn");
+	if (board->player == COLOR_SIZE) return parse_error(string, s, "FEN: bad player's turn");
 	++s;
 	// castling
 	s = parse_next(s);
@@ -828,37 +1002,35 @@ void board_set(Board *board, char *string) {
 		}
 	}
 	// correct castling
-	if (board->cpiece[E1] == WKING) {
-		if (board->cpiece[H1] != WROOK) board->castling &= ~1;
-		if (board->cpiece[A1] != WROOK) board->castling &= ~2;
+	if (board_cpiece(board, E1) == WKING) {
+		if (board_cpiece(board, H1) != WROOK) board->castling &= ~1;
+		if (board_cpiece(board, A1) != WROOK) board->castling &= ~2;
 	} else board->castling &= ~3;
-	if (board->cpiece[E8] == BKING) {
-		if (board->cpiece[H8] != BROOK) board->castling &= ~4;
-		if (board->cpiece[A8] != BROOK) board->castling &= ~8;
+	if (board_cpiece(board, E8) == BKING) {
+		if (board_cpiece(board, H8) != BROOK) board->castling &= ~4;
+		if (board_cpiece(board, A8) != BROOK) board->castling &= ~8;
 	} else board->castling &= ~12;
 	// en passant
 	x = ENPASSANT_NONE;
 	s = parse_next(s);
 	if (*s == '-') s++;
-	else if (!square_parse(&s, &x)) parse_error(string, s, "FEN: bad enpassant square");
+	else if (!square_parse(&s, &x)) return parse_error(string, s, "FEN: bad enpassant square");
 	board->enpassant = x;
 	// update other chess board structure
 	key_set(&board->key, board);
 	generate_checkers(board);
+
+	return true;
 }
 
-/* Play a move on the board. */
-void board_copymake(const Board *board, const Move move, const Key *key, Board *next) {
-	const Square from = move_from(move);
-	const Square to = move_to(move);
+/* Play a move, whose piece & promotion are known, on the board, without the checkers & pinned pieces of the new
+ * position. */
+static inline void board_play(const Board *board, const Square from, const Square to, const Piece p, const Piece promotion, const Key *key, Board *next) {
 	const Square enpassant = board->enpassant;
-	CPiece cp = board->cpiece[from];
-	Piece p = cpiece_piece(cp);
-	const Color c = cpiece_color(cp);
+	const Color c = board->player;
+	const Color o = opponent(c);
 	const Bitboard b_from = square_to_bit(from);
 	const Bitboard b_to = square_to_bit(to);
-	const CPiece victim = board->cpiece[to];
-	Square x;
 	Bitboard b;
 
 	*next = *board;
@@ -866,46 +1038,49 @@ void board_copymake(const Board *board, const Move move, const Key *key, Board *
 	// update chess board informations
 	next->enpassant = ENPASSANT_NONE;
 	next->castling &= MASK_CASTLING[from] & MASK_CASTLING[to];
-	// move the piece
-	next->piece[p] ^= b_from;
-	next->piece[p] ^= b_to;
-	next->color[c] ^= b_from | b_to;
-	next->cpiece[from] = EMPTY;
-	next->cpiece[to] = cp;
 	// capture
-	if (victim) {
-		next->piece[cpiece_piece(victim)] ^= b_to;
-		next->color[cpiece_color(victim)] ^= b_to;
+	if (board->color[o] & b_to) {
+		next->piece[board_piece(board, to)] ^= b_to;
+		next->color[o] ^= b_to;
 	}
+	// move the piece
+	next->piece[p] ^= b_from | b_to;
+	next->color[c] ^= b_from | b_to;
 	// special pawn move
 	if (p == PAWN) {
-		if ((p = move_promotion(move))) {
-			cp = cpiece_make(p, c);
+		if (promotion) {
 			next->piece[PAWN] ^= b_to;
-			next->piece[p] ^= b_to;
-			next->cpiece[to] = cp;
+			next->piece[promotion] ^= b_to;
 		} else if (enpassant == to) {
-			x = square(file(to), rank(from));
-			b = square_to_bit(x);
+			b = square_to_bit(square(file(to), rank(from)));
 			next->piece[PAWN] ^= b;
-			next->color[opponent(c)] ^= b;
-			next->cpiece[x] = EMPTY;
-		} else if (abs(to - from) == 16 && (MASK[to].enpassant & (next->color[opponent(c)] & next->piece[PAWN]))) {
+			next->color[o] ^= b;
+		} else if (abs(to - from) == 16 && (MASK[to].enpassant & (next->color[o] & next->piece[PAWN]))) {
 			next->enpassant = (from + to) / 2;
 		}
 	// king move
 	} else if (p == KING) {
 		next->x_king[c] = to;
-		if (to == from + 2) board_deplace_piece(next, from + 3, from + 1);
-		else if (to == from - 2) board_deplace_piece(next, from - 4, from - 1);
+		if (to == from + 2) board_deplace_piece(next, from + 3, from + 1, ROOK, c);
+		else if (to == from - 2) board_deplace_piece(next, from - 4, from - 1, ROOK, c);
 	}
 
 	++next->ply;
-	next->player = opponent(next->player);
+	next->player = o;
 	next->key = *key;
+}
+
+/* Play a move, whose piece & promotion are known, on the board, ready to be expanded. */
+static inline void board_make(const Board *board, const Square from, const Square to, const Piece p, const Piece promotion, const Key *key, Board *next) {
+	board_play(board, from, to, p, promotion, key, next);
 	generate_checkers(next);
 }
 
+/* Play a move on the board. */
+static void board_copymake(const Board *board, const Move move, const Key *key, Board *next) {
+	board_make(board, move_from(move), move_to(move), board_piece(board, move_from(move)), move_promotion(move), key, next);
+}
+
 /* Print the board. */
 void board_print(const Board *board, FILE *output) {
 	Square x;
@@ -919,7 +1094,7 @@ void board_print(const Board *board, FILE *output) {
 		for (f = 0; f <= 7; ++f) {
 			x = square(f, r);
 			if (f == 0) fprintf(output, "%1d ", r + 1);
-			fputc(p[board->cpiece[x]], output); fputc(' ', output);
+			fputc(p[board_cpiece(board, x)], output); fputc(' ', output);
 			if (f == 7) fprintf(output, "%1d\n", r + 1);
 		}
 	}
@@ -934,16 +1109,85 @@ void board_print(const Board *board, FILE *output) {
 }
 
 
-/* Check if a square is attacked.*/
-bool board_is_square_attacked(const Board *board, const Square x, const Color c) {
-	const Bitboard occupied = board->color[WHITE] + board->color[BLACK];
+/* Write the board as the four first fields of a FEN string, i.e. an EPD position. */
+char* board_to_fen(const Board *board, char *s) {
+	static _Thread_local char string[96];
+	const char p[] = ".PpNnBbRrQqKk#";
+	const Square ep = board->enpassant;
+	CPiece q;
+	char *t;
+	int f, r, empty;
+
+	if (s == NULL) s = string;
+	t = s;
+	for (r = 7; r >= 0; --r) {
+		for (empty = 0, f = 0; f <= 7; ++f) {
+			q = board_cpiece(board, square(f, r));
+			if (q == EMPTY) ++empty;
+			else {
+				if (empty) *t++ = '0' + empty, empty = 0;
+				*t++ = p[q];
+			}
+		}
+		if (empty) *t++ = '0' + empty;
+		if (r > 0) *t++ = '/';
+	}
+	*t++ = ' ';
+	*t++ = "wb"[board->player];
+	*t++ = ' ';
+	if (board->castling == 0) *t++ = '-';
+	if (board->castling & CAN_CASTLE_KINGSIDE[WHITE]) *t++ = 'K';
+	if (board->castling & CAN_CASTLE_QUEENSIDE[WHITE]) *t++ = 'Q';
+	if (board->castling & CAN_CASTLE_KINGSIDE[BLACK]) *t++ = 'k';
+	if (board->castling & CAN_CASTLE_QUEENSIDE[BLACK]) *t++ = 'q';
+	*t++ = ' ';
+	if (board_enpassant(board)) *t++ = file(ep) + 'a', *t++ = rank(ep) + '1';
+	else *t++ = '-';
+	*t = '\0';
+
+	return s;
+}
+
+/* Squares attacked by a color, seen through the king of the other color, which cannot hide behind itself */
+static inline Bitboard board_attack(const Board *board, const Color c) {
 	const Bitboard C = board->color[c];
+	const Bitboard occupied = (board->color[WHITE] + board->color[BLACK]) ^ square_to_bit(board->x_king[opponent(c)]);
+	Bitboard piece, attack;
+
+	piece = board->piece[PAWN] & C;
+	attack = c ? ((piece & ~COLUMN[0]) >> 9) | ((piece & ~COLUMN[7]) >> 7) : ((piece & ~COLUMN[0]) << 7) | ((piece & ~COLUMN[7]) << 9);
+	piece = board->piece[KNIGHT] & C;
+	while (piece) attack |= MASK[square_next(&piece)].knight;
+	piece = (board->piece[BISHOP] | board->piece[QUEEN]) & C;
+	while (piece) attack |= bishop_attack(occupied, square_next(&piece), -1ull);
+	piece = (board->piece[ROOK] | board->piece[QUEEN]) & C;
+	while (piece) attack |= rook_attack(occupied, square_next(&piece), -1ull);
+
+	return attack | MASK[board->x_king[c]].king;
+}
+
+/* Castling candidates: the king destinations allowed by the castling rights, with an empty path to the rook */
+static inline Bitboard castle_candidates(const int castling, const Color c, const Square k, const Bitboard occupied) {
+	Bitboard castle = 0;
+
+	if ((castling & CAN_CASTLE_KINGSIDE[c]) && (occupied & BETWEEN[k][k + 3]) == 0) castle |= square_to_bit(k + 2);
+	if ((castling & CAN_CASTLE_QUEENSIDE[c]) && (occupied & BETWEEN[k][k - 4]) == 0) castle |= square_to_bit(k - 2);
+	return castle;
+}
 
-	return bishop_attack(occupied, x, C & (board->piece[BISHOP] | board->piece[QUEEN]))
-	    || rook_attack(occupied, x, C & (board->piece[ROOK] | board->piece[QUEEN]))
-	    || knight_attack(x, C & board->piece[KNIGHT])
-	    || pawn_attack(x, opponent(c), C & board->piece[PAWN])
-	    || king_attack(x, C & board->piece[KING]);
+/* Castling candidates of a board */
+static inline Bitboard board_castle(const Board *board, const Color c, const Bitboard occupied) {
+	return castle_candidates(board->castling, c, board->x_king[c], occupied);
+}
+
+/* Castling candidates whose squares crossed by the king are not attacked */
+static inline Bitboard board_castle_safe(const Bitboard castle, const Square k, const Bitboard attacked) {
+	Bitboard safe = 0;
+
+	if (castle == 0) return 0;
+	if ((castle & square_to_bit(k + 2)) && (attacked & BETWEEN[k][k + 3]) == 0) safe |= square_to_bit(k + 2);
+	if ((castle & square_to_bit(k - 2)) && (attacked & BETWEEN[k][k - 3]) == 0) safe |= square_to_bit(k - 2);
+	return safe;
 }
 
 /* Append a move to an array of moves */
@@ -964,7 +1208,7 @@ static inline Move* push_promotion(Move *move, const Square from, const Square t
 }
 
 /* Append all moves from a square */
-Move* push_moves(Move *move, Bitboard attack, const Square from) {
+static Move* push_moves(Move *move, Bitboard attack, const Square from) {
 	Square to;
 
 	while (attack) {
@@ -975,7 +1219,7 @@ Move* push_moves(Move *move, Bitboard attack, const Square from) {
 }
 
 /* Append all pawn moves from a direction */
-Move* push_pawn_moves(Move *move, Bitboard attack, const int dir) {
+static Move* push_pawn_moves(Move *move, Bitboard attack, const int dir) {
 	Square to;
 
 	while (attack) {
@@ -986,7 +1230,7 @@ Move* push_pawn_moves(Move *move, Bitboard attack, const int dir) {
 }
 
 /* Append all promotions from a direction */
-Move *push_promotions(Move *move, Bitboard attack, const int dir) {
+static Move *push_promotions(Move *move, Bitboard attack, const int dir) {
 	Square to;
 
 	while (attack) {
@@ -996,8 +1240,70 @@ Move *push_promotions(Move *move, Bitboard attack, const int dir) {
 	return move;
 }
 
+/* Move sets counted at once by a vectorised popcount (USE_SIMD_COUNT), or one by one */
+typedef struct MoveCount {
+#if defined(USE_SIMD_COUNT)
+	Bitboard set[COUNT_SET_SIZE];
+	int n;
+#endif
+	int count;
+} MoveCount;
+
+/* Add a move set to count */
+static inline void count_set(MoveCount *mc, const Bitboard set) {
+#if defined(USE_SIMD_COUNT)
+	mc->set[mc->n++] = set;
+#else
+	mc->count += stdc_count_ones_ull(set);
+#endif
+}
+
+/* Add a promotion set to count: one move per promoted piece */
+static inline void count_promotions(MoveCount *mc, const Bitboard set) {
+#if defined(USE_SIMD_COUNT)
+	if (set) for (int i = 0; i < 4; ++i) mc->set[mc->n++] = set;
+#else
+	mc->count += 4 * stdc_count_ones_ull(set);
+#endif
+}
+
+/* Count the moves of all the sets */
+static inline int count_sets(const MoveCount *mc) {
+#if defined(USE_SIMD_COUNT) && defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+	__m512i sum = _mm512_setzero_si512();
+
+	for (int i = 0; i < mc->n; i += 8) {
+		const __mmask8 lanes = mc->n - i >= 8 ? 0xff : (1u << (mc->n - i)) - 1;
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(lanes, mc->set + i)));
+	}
+	return mc->count + _mm512_reduce_add_epi64(sum);
+#elif defined(USE_SIMD_COUNT) && defined(__AVX2__)
+	// popcount emulation: a nibble lookup table & a sum of the bytes of each lane
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i sum = _mm256_setzero_si256(), v, bytes;
+	int i, count = mc->count;
+
+	for (i = 0; i + 4 <= mc->n; i += 4) {
+		v = _mm256_loadu_si256((const __m256i*) (mc->set + i));
+		bytes = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble)), _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+	}
+	count += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) + _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+	for (; i < mc->n; ++i) count += stdc_count_ones_ull(mc->set[i]);
+	return count;
+#elif defined(USE_SIMD_COUNT)
+	int count = mc->count;
+
+	for (int i = 0; i < mc->n; ++i) count += stdc_count_ones_ull(mc->set[i]);
+	return count;
+#else
+	return mc->count;
+#endif
+}
+
 /* Generate all legal moves */
-int generate_moves(Board *board, Move *move, const bool generate, const bool do_quiet) {
+static int generate_moves(Board *board, Move *move, const bool generate, const bool do_quiet) {
 	const Color c = board->player;
 	const Color o = opponent(c);
 	const Bitboard occupied = board->color[WHITE] + board->color[BLACK];
@@ -1010,19 +1316,20 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 	const int pawn_left = PUSH[c] - 1;
 	const int pawn_right = PUSH[c] + 1;
 	const int pawn_push = PUSH[c];
-	const int *dir = MASK[k].direction;
+	const int8_t *dir = DIRECTION[k];
 	const Move *start = move;
-	Bitboard target, piece, attack;
+	Bitboard target, piece, attack, attacked, castle = 0;
 	Bitboard empty = ~occupied;
 	Bitboard enemy = board->color[o];
 	Square from, to, ep, x_checker = ENPASSANT_NONE;
+	MoveCount mc = {.count = 0};
 	int d, count = 0;
 
 	// in check: capture or block the (single) checker if any;
 	if (checkers) {
 		if (stdc_has_single_bit_ull(checkers)) {
 			x_checker = square_first(checkers);
-			empty = MASK[k].between[x_checker];
+			empty = BETWEEN[k][x_checker];
 			enemy = checkers;
 		} else {
 			empty = enemy  = 0;
@@ -1031,21 +1338,8 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 	// not in check: castling & pinned pieces moves
 	} else {
 		target = enemy; if (do_quiet) target |= empty;
-		// castling
-		if (do_quiet) {
-			if ((board->castling & CAN_CASTLE_KINGSIDE[c])
-				&& (occupied & MASK[k].between[k + 3]) == 0
-				&& !board_is_square_attacked(board, k + 1, o)
-				&& !board_is_square_attacked(board, k + 2, o)) {
-					if (generate) move = push_move(move, k, k + 2); else ++count;
-			}
-			if ((board->castling & CAN_CASTLE_QUEENSIDE[c])
-				&& (occupied & MASK[k].between[k - 4]) == 0
-				&& !board_is_square_attacked(board, k - 1, o)
-				&& !board_is_square_attacked(board, k - 2, o)) {
-					if (generate) move = push_move(move, k, k - 2); else ++count;
-			}
-		}
+		// castling candidates, with an empty path
+		if (do_quiet) castle = board_castle(board, c, occupied);
 		// pawn (pinned)
 		piece = board->piece[PAWN] & pinned;
 		while (piece) {
@@ -1053,17 +1347,17 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 			d = dir[from];
 			if (d == abs(pawn_left) && (square_to_bit(to = from + pawn_left) & pawn_attack(from, c, enemy))) {
 				if (generate) move = is_on_seventh_rank(from, c) ? push_promotion(move, from, to) : push_move(move,from, to);
-				else count += is_on_seventh_rank(from, c) ? 4 : 1;
+				else if (is_on_seventh_rank(from, c)) count_promotions(&mc, square_to_bit(to)); else count_set(&mc, square_to_bit(to));
 
 			} else if (d == abs(pawn_right) && (square_to_bit(to = from + pawn_right) & pawn_attack(from, c, enemy))) {
 				if (generate) move = is_on_seventh_rank(from, c) ? push_promotion(move, from, to) : push_move(move,from, to);
-				else count += is_on_seventh_rank(from, c) ? 4 : 1;
+				else if (is_on_seventh_rank(from, c)) count_promotions(&mc, square_to_bit(to)); else count_set(&mc, square_to_bit(to));
 			}
 			if (do_quiet && d == abs(pawn_push) && (square_to_bit(to = from + pawn_push) & empty)) {
-				if (generate) move = push_move(move, from, to); else ++count;
-				if (is_on_second_rank(from, c) && (square_to_bit(to += pawn_push) & empty)) {
-					if (generate) move = push_move(move, from, to); else ++count;
-				}
+				// single & double pushes, counted as one set
+				attack = square_to_bit(to);
+				if (is_on_second_rank(from, c) && (square_to_bit(to + pawn_push) & empty)) attack |= square_to_bit(to + pawn_push);
+				if (generate) move = push_moves(move, attack, from); else count_set(&mc, attack);
 			}
 		}
 		// bishop or queen (pinned)
@@ -1072,9 +1366,9 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 			from = square_next(&piece);
 			d = dir[from];
 			attack = 0;
-			if (d == 9) attack = bishop_attack(occupied, from, target & MASK[from].diagonal);
-			else if (d == 7) attack = bishop_attack(occupied, from, target & MASK[from].antidiagonal);
-			if (generate) move = push_moves(move, attack, from); else count += stdc_count_ones_ull(attack);
+			if (d == 9) attack = bishop_attack(occupied, from, target & LINE[from].diagonal);
+			else if (d == 7) attack = bishop_attack(occupied, from, target & LINE[from].antidiagonal);
+			if (generate) move = push_moves(move, attack, from); else count_set(&mc, attack);
 		}
 		// rook or queen (pinned)
 		piece = rq & pinned;
@@ -1082,9 +1376,9 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 			from = square_next(&piece);
 			d = dir[from];
 			attack = 0;
-			if (d == 1) attack = rook_attack(occupied, from, target & MASK[from].rank);
-			else if (d == 8) attack = rook_attack(occupied, from, target & MASK[from].file);
-			if (generate) move = push_moves(move, attack, from); else count += stdc_count_ones_ull(attack);
+			if (d == 1) attack = rook_attack(occupied, from, target & LINE[from].rank);
+			else if (d == 8) attack = rook_attack(occupied, from, target & LINE[from].file);
+			if (generate) move = push_moves(move, attack, from); else count_set(&mc, attack);
 		}
 	}
 	// common moves
@@ -1096,14 +1390,14 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 		to = board->enpassant;
 		ep = to - pawn_push;
 		from = ep - 1;
-		if (file(to) > 0 && board->cpiece[from] == cpiece_make(PAWN, c)) {
+		if (file(to) > 0 && (board->piece[PAWN] & board->color[c] & square_to_bit(from))) {
 			piece = occupied ^ square_to_bit(from) ^ square_to_bit(ep) ^ square_to_bit(to);
 			if (!bishop_attack(piece, k, bq & board->color[o]) && !rook_attack(piece, k, rq & board->color[o])) {
 				if (generate) move = push_move(move, from, to); else ++count;
 			}
 		}
 		from = ep + 1;
-		if (file(to) < 7 && board->cpiece[from] == cpiece_make(PAWN, c)) {
+		if (file(to) < 7 && (board->piece[PAWN] & board->color[c] & square_to_bit(from))) {
 			piece = occupied ^ square_to_bit(from) ^ square_to_bit(ep) ^ square_to_bit(to);
 			if (!bishop_attack(piece, k, bq & board->color[o]) && !rook_attack(piece, k, rq & board->color[o])) {
 				if (generate) move = push_move(move, from, to); else ++count;
@@ -1117,24 +1411,30 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 	if (generate) {
 		move = push_promotions(move, attack & PROMOTION_RANK[c], pawn_left);
 		move = push_pawn_moves(move, attack & ~PROMOTION_RANK[c], pawn_left);
-	} else count += 4 * stdc_count_ones_ull(attack & PROMOTION_RANK[c]) + stdc_count_ones_ull(attack & ~PROMOTION_RANK[c]);
+	} else {
+		count_promotions(&mc, attack & PROMOTION_RANK[c]);
+		count_set(&mc, attack & ~PROMOTION_RANK[c]);
+	}
 
 	attack = (c ? (piece & ~COLUMN[7]) >> 7 : (piece & ~COLUMN[7]) << 9) & enemy;
 	if (generate) {
 		move = push_promotions(move, attack & PROMOTION_RANK[c], pawn_right);
 		move = push_pawn_moves(move, attack & ~PROMOTION_RANK[c], pawn_right);
-	} else count += 4 * stdc_count_ones_ull(attack & PROMOTION_RANK[c]) + stdc_count_ones_ull(attack & ~PROMOTION_RANK[c]);
+	} else {
+		count_promotions(&mc, attack & PROMOTION_RANK[c]);
+		count_set(&mc, attack & ~PROMOTION_RANK[c]);
+	}
 
 	attack = (c ? piece >> 8 : piece << 8) & empty;
 	if (generate) {
 		move = push_promotions(move, attack & PROMOTION_RANK[c], pawn_push);
-	} else count += 4 * stdc_count_ones_ull(attack & PROMOTION_RANK[c]);
+	} else count_promotions(&mc, attack & PROMOTION_RANK[c]);
 	if (do_quiet) {
 		if (generate) {
 			move = push_pawn_moves(move, attack & ~PROMOTION_RANK[c], pawn_push);
-		} else count += stdc_count_ones_ull(attack & ~PROMOTION_RANK[c]);
+		} else count_set(&mc, attack & ~PROMOTION_RANK[c]);
 		attack = (c ? (((piece & RANK[6]) >> 8) & ~occupied) >> 8 : (((piece & RANK[1]) << 8) & ~occupied) << 8) & empty;
-		if (generate) move = push_pawn_moves(move, attack, 2 * pawn_push); else count += stdc_count_ones_ull(attack);
+		if (generate) move = push_pawn_moves(move, attack, 2 * pawn_push); else count_set(&mc, attack);
 	}
 
 	// knight
@@ -1142,7 +1442,7 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 	while (piece) {
 		from = square_next(&piece);
 		attack = knight_attack(from, target);
-		if (generate) move = push_moves(move, attack, from); else count += stdc_count_ones_ull(attack);
+		if (generate) move = push_moves(move, attack, from); else count_set(&mc, attack);
 	}
 
 	// bishop or queen
@@ -1150,7 +1450,7 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 	while (piece) {
 		from = square_next(&piece);
 		attack = bishop_attack(occupied, from, target);
-		if (generate) move = push_moves(move, attack, from); else count += stdc_count_ones_ull(attack);
+		if (generate) move = push_moves(move, attack, from); else count_set(&mc, attack);
 	}
 
 	// rook or queen
@@ -1158,22 +1458,20 @@ int generate_moves(Board *board, Move *move, const bool generate, const bool do_
 	while (piece) {
 		from = square_next(&piece);
 		attack = rook_attack(occupied, from, target);
-		if (generate) move = push_moves(move, attack, from); else count += stdc_count_ones_ull(attack);
+		if (generate) move = push_moves(move, attack, from); else count_set(&mc, attack);
 	}
 
-	// king
-	board->color[c] ^= square_to_bit(k);
+	// king & castling, out of the squares attacked by the opponent
 	target = board->color[o]; if (do_quiet) target |= ~occupied;
 	attack = king_attack(k, target);
-	while (attack) {
-		to = square_next(&attack);
-		if (!board_is_square_attacked(board, to, o)) {
-			if (generate) move = push_move(move, k, to); else ++count;
-		}
+	if (attack | castle) {
+		attacked = board_attack(board, o);
+		attack = (attack & ~attacked) | board_castle_safe(castle, k, attacked);
+		if (generate) move = push_moves(move, attack, k); else count_set(&mc, attack);
 	}
-	board->color[c] ^= square_to_bit(k);
 
 	if (generate) count = move - start;
+	else count += count_sets(&mc);
 
 	return count;
 }
@@ -1190,101 +1488,2542 @@ static inline Move movearray_next(MoveArray *ma) {
 	return ma->move[ma->i++];
 }
 
-/* Hash creation */
-HashTable* hash_create(const size_t size) {
-	const size_t n = stdc_bit_floor_ull(size << 20) / sizeof(Hash);
-
-	HashTable *hashtable = malloc(sizeof (HashTable));
-	if (hashtable == NULL) memory_error(__func__);
-	hashtable->hash = aligned_alloc(32, (n + BUCKET_SIZE) * sizeof (Hash));
-	if (hashtable->hash == NULL) memory_error(__func__);
-	hashtable->mask = n - 1;
+/* Wide hash creation: few entries with 128-bit counts, for the high depths */
+static WideHash* hash_create_wide(void) {
+	return calloc(WIDE_HASH_SIZE + BUCKET_SIZE, sizeof (WideHash));
+}
 
-	return hashtable;
+/* Small hash creation: a cache for the low depths, kept apart from the main hashtable */
+static Hash* hash_create_small(void) {
+	Hash *small = aligned_alloc(32, (SMALL_HASH_SIZE + BUCKET_SIZE) * sizeof (Hash));
+	if (small) memset(small, 0, (SMALL_HASH_SIZE + BUCKET_SIZE) * sizeof (Hash));
+	return small;
 }
 
-/* Hash free resources */
-void hash_destroy(HashTable *hashtable) {
-	if (hashtable) free(hashtable->hash);
-	free(hashtable);
+/* Bucket of a key in the main hashtable: a multiply-shift of the 64-bit key index into [0, size), so the
+ * hashtable may have any number of entries */
+static inline uint64_t hash_index(const HashTable *hashtable, const Key *key) {
+	return (uint64_t) (((Count) key->index * hashtable->size) >> 64);
 }
 
-/* Hash clear */
-static inline void hash_clear(HashTable *hashtable) {
-	memset(hashtable->hash, 0, (hashtable->mask + BUCKET_SIZE + 1) * sizeof(Hash));
+/* Zero a chunk of memory */
+typedef struct MemoryChunk {
+	char *start;
+	size_t size;
+} MemoryChunk;
+
+static void* memory_zero_chunk(void *data) {
+	MemoryChunk *chunk = data;
+
+	memset(chunk->start, 0, chunk->size);
+
+	return NULL;
 }
 
-/* Hash probe */
-uint64_t hash_probe(const HashTable *hashtable, const Key *key, const int depth) {
-	Hash *hash = hashtable->hash + (key->index & hashtable->mask);
+/* Zero a large memory area with one thread per cpu, each one touching, and so faulting in, its own pages */
+static void memory_zero(void *start, const size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+	enum { CHUNK_MIN = 64 << 20 };
+	MemoryChunk chunk[CPU_SIZE];
+	pthread_t thread[CPU_SIZE];
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	int i;
 
-	for (int i = 0; i < BUCKET_SIZE; ++i) {
-		if (hash[i].code == key->code && (hash[i].data & 0x3f) == depth) return hash[i].data >> 6;
+	if (n > (long) (size / CHUNK_MIN)) n = size / CHUNK_MIN;
+	if (n > CPU_SIZE) n = CPU_SIZE;
+	if (n > 1) {
+		for (i = 0; i < n; ++i) {
+			chunk[i].start = (char*) start + size * i / n;
+			chunk[i].size = size * (i + 1) / n - size * i / n;
+			if (pthread_create(thread + i, NULL, memory_zero_chunk, chunk + i)) memory_zero_chunk(chunk + i), thread[i] = 0;
+		}
+		for (i = 0; i < n; ++i) if (thread[i]) pthread_join(thread[i], NULL);
+		return;
 	}
-	return 0;
+#endif
+	memset(start, 0, size);
 }
 
-/* Hash store */
-void hash_store(const HashTable *hashtable, const Key *key, const int depth, const uint64_t count) {
-	Hash *hash = (hashtable->hash + (key->index & hashtable->mask));
-	const uint64_t data = count << 6 | depth;
-	int i, j;
+/* Hash policy of a depth. The keys are needed from the lowest hashed depth up */
+static void hash_policy_set(HashTable *hashtable, const int depth, const HashMode mode) {
+	// a detailed statistics hashtable holds no counts: the count engines never hash into it
+	hashtable->policy[depth] = hashtable->hash ? mode : HASH_OFF;
+	for (hashtable->key_depth = 1; hashtable->key_depth < PLY_SIZE - 1 && hashtable->policy[hashtable->key_depth] == HASH_OFF; ++hashtable->key_depth) ;
+}
 
-	for (i = j = 0; i < BUCKET_SIZE; ++i) {
-		if (hash[i].code == key->code && hash[i].data == data) return;
-		if (hash[i].data < hash[j].data) j = i;
-	}
+/* Hash policy: the fixed rule, hashing the subtrees from depth 2 in the main hashtable */
+static void hash_policy_init(HashTable *hashtable) {
+	for (int d = 0; d < PLY_SIZE; ++d) hash_policy_set(hashtable, d, d >= 2 ? HASH_MAIN : HASH_OFF);
+}
 
-	hash[j].code = key->code;
-	hash[j].data = data;
+/* Number of entries of a hashtable of <size> Mbytes, the last bucket overflowing */
+static size_t hash_size_entries(const size_t size, const size_t entry_size) {
+	const size_t n = (size << 20) / entry_size;
+
+	return n > 2 * (size_t) BUCKET_SIZE ? n - BUCKET_SIZE : (size_t) BUCKET_SIZE;
 }
 
-/* Prefetch */
-static inline void hash_prefetch(HashTable *hashtable, const Key *key) {
-	_mm_prefetch((const char*) (hashtable->hash + (key->index & hashtable->mask)), _MM_HINT_T2);
+/* Hash creation, using all the requested size. The entries are left uninitialized, to be first touched by
+ * hash_reset() or hash_place(). */
+HashTable* hash_create(const size_t size, const bool detailed) {
+	HashTable *hashtable = calloc(1, sizeof (HashTable));
+	size_t n;
+
+	if (hashtable == NULL) {
+		memory_error(__func__);
+		return NULL;
+	}
+	if (detailed) {
+		n = hash_size_entries(size, sizeof (StatsHash));
+		hashtable->stats = aligned_alloc(32, ((n + BUCKET_SIZE) * sizeof (StatsHash) + 31) & ~(size_t) 31);
+	} else {
+		n = hash_size_entries(size, sizeof (Hash));
+		hashtable->hash = aligned_alloc(32, (n + BUCKET_SIZE) * sizeof (Hash));
+		hashtable->wide = hash_create_wide();
+		hashtable->small = hash_create_small();
+	}
+	if (detailed ? hashtable->stats == NULL : (hashtable->hash == NULL || hashtable->wide == NULL || hashtable->small == NULL)) {
+		memory_error(__func__);
+		hash_destroy(hashtable);
+		return NULL;
+	}
+	hashtable->small_mask = SMALL_HASH_SIZE - 1;
+	hashtable->size = n;
+	hashtable->generation = 1;
+	hashtable->do_quiet = true;
+	hash_policy_init(hashtable);
+
+	return hashtable;
 }
 
-/* Recursive Perft with optional hashtable, bulk counting & capture only generation */
-uint64_t perft(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
-	Board next;
-	uint64_t count = 0, hash_count;
-	Move move;
-	MoveArray ma;
-	const bool use_hash = (hashtable && depth > 2);
-	Key key;
+/* Hashtable size (in Mbytes) for the available memory: half of it, leaving room for the rest of the system */
+size_t hash_auto_size(void) {
+	unsigned long long available = 0;
+#if defined(__linux__)
+	FILE *file = fopen("/proc/meminfo", "r");
+	char line[256];
 
-	movearray_generate(&ma, board, do_quiet || board->checkers);
+	if (file) {
+		while (fgets(line, sizeof line, file)) if (sscanf(line, "MemAvailable: %llu kB", &available) == 1) break;
+		fclose(file);
+	}
+	available >>= 10;
+#endif
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PAGESIZE)
+	if (available == 0 && sysconf(_SC_AVPHYS_PAGES) > 0) available = ((unsigned long long) sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE)) >> 20;
+#endif
+	return available >= 2 ? available / 2 : 256;
+}
 
-	while ((move = movearray_next(&ma)) != 0) {
-		if (use_hash) {
-			key_update(&key, board, move);
-			hash_prefetch(hashtable, &key);
-		}
-		board_copymake(board, move, &key, &next);
-		if (depth == 1) ++count;
-		else if (bulk && depth == 2) count += generate_moves(&next, NULL, false, do_quiet || next.checkers);
-		else {
-			if (use_hash) {
-				hash_count = hash_probe(hashtable, &key, depth - 1);
-				if (hash_count == 0) {
-					hash_count = perft(&next, hashtable, depth - 1, bulk, do_quiet);
-					hash_store(hashtable, &key, depth - 1, hash_count);
-				}
-				count += hash_count;
-			} else count += perft(&next, hashtable, depth - 1, bulk, do_quiet);
+#if defined(__unix__) || defined(__APPLE__)
+/* Hash creation in a named POSIX shared memory, or attachment to an existing one. NULL on failure. */
+HashTable* hash_create_shared(const char *name, const size_t size, const uint64_t seed, const bool do_quiet) {
+	const size_t n = hash_size_entries(size, sizeof (Hash));
+	const size_t bytes = sizeof (HashHeader) + (n + BUCKET_SIZE) * sizeof (Hash);
+	HashTable *hashtable = calloc(1, sizeof (HashTable));
+	HashHeader *header;
+	struct stat st;
+	bool created = true;
+	int fd, i;
+
+	if (hashtable == NULL || (hashtable->wide = hash_create_wide()) == NULL || (hashtable->small = hash_create_small()) == NULL) {
+		memory_error(__func__);
+		hash_destroy(hashtable);
+		return NULL;
+	}
+	// the first process creates & sizes the shared memory; the others wait for its size & have to agree with it.
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd >= 0) {
+		if (ftruncate(fd, bytes) < 0) {
+			perror("Error: ftruncate");
+			close(fd);
+			shm_unlink(name);
+			hash_destroy(hashtable);
+			return NULL;
 		}
+	} else if (errno == EEXIST) {
+		created = false;
+		fd = shm_open(name, O_RDWR, 0666);
+		for (i = 0; fd >= 0 && fstat(fd, &st) == 0 && st.st_size == 0 && i < 1000; ++i) usleep(1000);
+	}
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("Error: shm_open");
+		if (fd >= 0) close(fd);
+		hash_destroy(hashtable);
+		return NULL;
+	}
+	if ((size_t) st.st_size != bytes) {
+		fprintf(stderr, "Error: shared hashtable '%s' has %llu bytes, %llu expected\n", name, (unsigned long long) st.st_size, (unsigned long long) bytes);
+		close(fd);
+		hash_destroy(hashtable);
+		return NULL;
+	}
+	header = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED) {
+		memory_error(__func__);
+		hash_destroy(hashtable);
+		return NULL;
+	}
+	hashtable->header = header;
+
+	// the creator writes the header of the new (zeroed) shared memory; the magic is written last.
+	if (created) {
+		header->version = HASH_VERSION;
+		header->entry_size = sizeof (Hash);
+		header->seed = seed;
+		header->entries = n + BUCKET_SIZE;
+		header->do_quiet = do_quiet;
+		__sync_synchronize();
+		memcpy(header->magic, HASH_MAGIC, sizeof HASH_MAGIC);
+	}
+	for (i = 0; i < 1000 && memcmp(header->magic, HASH_MAGIC, sizeof HASH_MAGIC); ++i) usleep(1000);
+	__sync_synchronize();
+	if (memcmp(header->magic, HASH_MAGIC, sizeof HASH_MAGIC) || header->version != HASH_VERSION || header->entry_size != sizeof (Hash)
+	 || header->seed != seed || header->entries != n + BUCKET_SIZE || header->do_quiet != do_quiet) {
+		fprintf(stderr, "Error: shared hashtable '%s' does not match this format, seed, size or capture mode\n", name);
+		munmap(header, bytes);
+		hashtable->header = NULL;
+		hash_destroy(hashtable);
+		return NULL;
 	}
 
-	return count;
+	hashtable->hash = (Hash*) (header + 1);
+	hashtable->small_mask = SMALL_HASH_SIZE - 1;
+	hashtable->size = n;
+	hashtable->generation = 1;
+	hashtable->do_quiet = do_quiet;
+	hash_policy_init(hashtable);
+
+	return hashtable;
 }
+#endif
 
-/* test */
-void test(void) {
-	Board board;
-	typedef struct TestBoard {
-		char *comments, *fen;
-		unsigned long long result;
-		int depth;
+/* Hash free resources */
+void hash_destroy(HashTable *hashtable) {
+	if (hashtable) {
+	#if defined(__unix__) || defined(__APPLE__)
+		if (hashtable->header) munmap(hashtable->header, sizeof (HashHeader) + hashtable->header->entries * sizeof (Hash));
+		else
+	#endif
+		free(hashtable->hash);
+		free(hashtable->stats);
+		free(hashtable->wide);
+		free(hashtable->small);
+		if (hashtable->verify) free(hashtable->verify->position);
+		free(hashtable->verify);
+	}
+	free(hashtable);
+}
+
+/* Hash number of entries */
+size_t hash_entries(const HashTable *hashtable) {
+	return hashtable->size + BUCKET_SIZE;
+}
+
+/* Hash size in bytes */
+size_t hash_bytes(const HashTable *hashtable) {
+	return hash_entries(hashtable) * (hashtable->stats ? sizeof (StatsHash) : sizeof (Hash));
+}
+
+/* Hash reset: zero all the entries, which makes them invalid for any generation */
+void hash_reset(HashTable *hashtable) {
+	if (hashtable->wide) memset(hashtable->wide, 0, (WIDE_HASH_SIZE + BUCKET_SIZE) * sizeof (WideHash));
+	if (hashtable->small) memset(hashtable->small, 0, (SMALL_HASH_SIZE + BUCKET_SIZE) * sizeof (Hash));
+	if (hashtable->verify) memset(hashtable->verify->position, 0, hash_entries(hashtable) * sizeof (Position));
+	if (hashtable->header) return;
+	else if (hashtable->stats) memory_zero(hashtable->stats, hash_bytes(hashtable));
+	else memory_zero(hashtable->hash, hash_bytes(hashtable));
+}
+
+/* Hash clear in O(1): entries of older generations no longer match and are replaced first.
+ * A shared hashtable is never cleared: its entries stay valid for all the processes using it */
+void hash_clear(HashTable *hashtable) {
+	if (hashtable->header) return;
+	if (++hashtable->generation > GENERATION_MASK) {
+		hash_reset(hashtable);
+		hashtable->generation = 1;
+	}
+}
+
+/* Hash fill: the fraction of a sample of entries used by the current generation */
+double hash_fill(const HashTable *hashtable) {
+	enum { N_SAMPLES = 4096 };
+	const size_t n = hash_entries(hashtable), step = n > N_SAMPLES ? n / N_SAMPLES : 1;
+	size_t i, used = 0, total = 0;
+
+	for (i = 0; i < n; i += step, ++total) {
+		if (hashtable->stats) used += (hashtable->stats[i].depth >> 8) == hashtable->generation;
+		else used += hashtable->hash[i].data && (hashtable->hash[i].code & GENERATION_MASK) == hashtable->generation;
+	}
+
+	return (double) used / total;
+}
+
+/* Hash probe of a bucket. The code is stored xored with the data, so an entry torn by a concurrent write never matches. */
+static inline uint64_t hash_probe_bucket(const Hash *hash, const uint64_t generation, const Key *key, const int depth) {
+	const uint64_t code = (key->code & ~GENERATION_MASK) | generation;
+	uint64_t data;
+
+	for (int i = 0; i < BUCKET_SIZE; ++i) {
+		data = hash[i].data;
+		if (hash[i].code == (code ^ (data & ~GENERATION_MASK)) && (data & 0x3f) == (uint64_t) depth) return data >> 6;
+	}
+	return 0;
+}
+
+/* Hash probe */
+static uint64_t hash_probe(const HashTable *hashtable, const Key *key, const int depth) {
+	return hash_probe_bucket(hashtable->hash + hash_index(hashtable, key), hashtable->generation, key, depth);
+}
+
+/* Priority of an entry to stay in the hashtable: entries from an older generation go first */
+static inline uint64_t hash_priority(const Hash *hash, const uint64_t generation) {
+	return (hash->code & GENERATION_MASK) == generation ? hash->data : 0;
+}
+
+/* Hash store into a bucket, returning the entry written if any. Counts too large for the 58 bits of an entry are not stored.
+ * The low bits of the code are replaced by the generation of the entry. */
+static inline Hash* hash_store_bucket(Hash *hash, const uint64_t generation, const Key *key, const int depth, const uint64_t count) {
+	const uint64_t data = count << 6 | depth;
+	const uint64_t code = ((key->code ^ data) & ~GENERATION_MASK) | generation;
+	int i, j;
+
+	if (count > NARROW_COUNT_MAX) return NULL;
+
+	for (i = j = 0; i < BUCKET_SIZE; ++i) {
+		if (hash[i].code == code && hash[i].data == data) return NULL;
+		if (hash_priority(hash + i, generation) < hash_priority(hash + j, generation)) j = i;
+	}
+
+	hash[j].code = code;
+	hash[j].data = data;
+
+	return hash + j;
+}
+
+/* Hash store into the main hashtable, returning the entry written if any */
+static inline Hash* hash_store_entry(const HashTable *hashtable, const Key *key, const int depth, const uint64_t count) {
+	return hash_store_bucket(hashtable->hash + hash_index(hashtable, key), hashtable->generation, key, depth, count);
+}
+
+/* Hash probe following the policy of the depth: the small hash or the main one */
+static inline uint64_t hash_probe_policy(const HashTable *hashtable, const Key *key, const int depth) {
+	if (hashtable->policy[depth] == HASH_SMALL) return hash_probe_bucket(hashtable->small + (key->index & hashtable->small_mask), hashtable->generation, key, depth);
+	return hash_probe(hashtable, key, depth);
+}
+
+/* Hash store following the policy of the depth */
+static inline void hash_store_policy(const HashTable *hashtable, const Key *key, const int depth, const uint64_t count) {
+	if (hashtable->policy[depth] == HASH_SMALL) hash_store_bucket(hashtable->small + (key->index & hashtable->small_mask), hashtable->generation, key, depth, count);
+	else hash_store_entry(hashtable, key, depth, count);
+}
+
+/* Mix a word into a fold. Unlike a xor, the mix is not linear, so a torn mix of two entries does not fold like one of them. */
+static inline uint64_t fold_mix(uint64_t h, const uint64_t x) {
+	h = (h ^ x) * 0x9e3779b97f4a7c15ull;
+	return h ^ (h >> 29);
+}
+
+/* Fold a 128-bit count into 64 bits */
+static inline uint64_t count_fold(const Count count) {
+	return fold_mix(fold_mix(0, (uint64_t) count), (uint64_t) (count >> 64));
+}
+
+/* Is an entry tagged a better one to replace than an entry tagged b? Entries of an older generation go first, then the lowest depths. */
+static inline bool hash_replace_tag(const uint64_t a, const uint64_t b, const uint64_t tag) {
+	const bool old_a = (a ^ tag) >> 8, old_b = (b ^ tag) >> 8;
+
+	return old_a != old_b ? old_a : a < b;
+}
+
+/* Hash probe a 128-bit count. As in the other tables, the code is xored with the data against torn entries. */
+static bool hash_probe_wide(const HashTable *hashtable, const Key *key, const int depth, Count *count) {
+	const WideHash *hash = hashtable->wide + (key->index & (WIDE_HASH_SIZE - 1));
+	const uint64_t tag = depth | hashtable->generation << 8;
+
+	for (int i = 0; i < BUCKET_SIZE; ++i) {
+		if (hash[i].depth == tag) {
+			*count = hash[i].count;
+			if ((hash[i].code ^ tag ^ count_fold(*count)) == key->code) return true;
+		}
+	}
+	return false;
+}
+
+/* Hash store a 128-bit count */
+static void hash_store_wide(const HashTable *hashtable, const Key *key, const int depth, const Count count) {
+	WideHash *hash = hashtable->wide + (key->index & (WIDE_HASH_SIZE - 1));
+	const uint64_t tag = depth | hashtable->generation << 8;
+	int i, j;
+
+	// replace the same position, else an entry of an older generation, else the lowest depth
+	for (i = j = 0; i < BUCKET_SIZE; ++i) {
+		if (hash[i].depth == tag && (hash[i].code ^ tag ^ count_fold(hash[i].count)) == key->code) {
+			j = i;
+			break;
+		}
+		if (hash_replace_tag(hash[i].depth, hash[j].depth, tag)) j = i;
+	}
+
+	hash[j].code = key->code ^ tag ^ count_fold(count);
+	hash[j].depth = tag;
+	hash[j].count = count;
+}
+
+/* Fold the statistics into 64 bits */
+static inline uint64_t stats_fold(const Stats *s) {
+	uint64_t h = fold_mix(0, s->leaves);
+
+	h = fold_mix(h, s->captures);
+	h = fold_mix(h, s->enpassants);
+	h = fold_mix(h, s->castles);
+	h = fold_mix(h, s->promotions);
+	h = fold_mix(h, s->checks);
+	h = fold_mix(h, s->discovery_checks);
+	h = fold_mix(h, s->double_checks);
+
+	return fold_mix(h, s->checkmates);
+}
+
+/* Hash probe detailed statistics. The code is xored with the data against torn entries. */
+static bool hash_probe_stats(const HashTable *hashtable, const Key *key, const int depth, Stats *stats) {
+	const StatsHash *hash = hashtable->stats + hash_index(hashtable, key);
+	const uint64_t tag = depth | hashtable->generation << 8;
+
+	for (int i = 0; i < BUCKET_SIZE; ++i) {
+		if (hash[i].depth == tag) {
+			*stats = hash[i].stats;
+			if ((hash[i].code ^ tag ^ stats_fold(stats)) == key->code) return true;
+		}
+	}
+	return false;
+}
+
+/* Hash store detailed statistics */
+static void hash_store_stats(const HashTable *hashtable, const Key *key, const int depth, const Stats *stats) {
+	StatsHash *hash = hashtable->stats + hash_index(hashtable, key);
+	const uint64_t tag = depth | hashtable->generation << 8;
+	const uint64_t code = key->code ^ tag ^ stats_fold(stats);
+	int i, j;
+
+	// keep the same position, else replace an entry of an older generation, else the lowest depth & count
+	for (i = j = 0; i < BUCKET_SIZE; ++i) {
+		if (hash[i].code == code && hash[i].depth == tag) return;
+		if (hash_replace_tag(hash[i].depth, hash[j].depth, tag) || (hash[i].depth == hash[j].depth && hash[i].stats.leaves < hash[j].stats.leaves)) j = i;
+	}
+
+	hash[j].code = code;
+	hash[j].depth = tag;
+	hash[j].stats = *stats;
+}
+
+/* Prefetch */
+static inline void hash_prefetch(HashTable *hashtable, const Key *key) {
+	if (hashtable->stats) _mm_prefetch((const char*) (hashtable->stats + hash_index(hashtable, key)), _MM_HINT_T2);
+	else _mm_prefetch((const char*) (hashtable->hash + hash_index(hashtable, key)), _MM_HINT_T2);
+}
+
+/* Set the position stored next to a hashtable entry */
+static inline void position_set(Position *position, const Board *board) {
+	*position = (Position) {.player = board->player, .castling = board->castling, .enpassant = board->enpassant};
+	memcpy(position->piece, board->piece, sizeof board->piece);
+	memcpy(position->color, board->color, sizeof board->color);
+}
+
+/* Add a collision verification side table to a private, non detailed hashtable; false on failure */
+bool hash_verify_create(HashTable *hashtable) {
+	if (hashtable->header || hashtable->stats) {
+		fprintf(stderr, "Error: hash verification needs a private hashtable without detailed statistics\n");
+		return false;
+	}
+	hashtable->verify = calloc(1, sizeof (HashVerify));
+	if (hashtable->verify) hashtable->verify->position = calloc(hash_entries(hashtable), sizeof (Position));
+	if (hashtable->verify == NULL || hashtable->verify->position == NULL) {
+		memory_error(__func__);
+		free(hashtable->verify);
+		hashtable->verify = NULL;
+		return false;
+	}
+	return true;
+}
+
+/* Hash probe comparing each entry of the right depth & generation with the position it was stored for.
+ * For a different position, record the largest number of stored code bits that would still have matched it.
+ * Only true matches are returned, so the perft count stays exact. */
+static uint64_t hash_probe_verify(const HashTable *hashtable, const Key *key, const int depth, const Board *board) {
+	const size_t bucket = hash_index(hashtable, key);
+	const Hash *hash = hashtable->hash + bucket;
+	HashVerify *verify = hashtable->verify;
+	Position position;
+	uint64_t data, diff, count = 0;
+
+	position_set(&position, board);
+	__atomic_fetch_add(&verify->probes, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < BUCKET_SIZE; ++i) {
+		data = hash[i].data;
+		if ((data & 0x3f) != (uint64_t) depth || (hash[i].code & GENERATION_MASK) != hashtable->generation) continue;
+		if (memcmp(verify->position + bucket + i, &position, sizeof (Position)) == 0) {
+			if (((hash[i].code ^ data ^ key->code) & ~GENERATION_MASK) == 0) count = data >> 6;
+		} else {
+			diff = (hash[i].code ^ data ^ key->code) & ~GENERATION_MASK;
+			__atomic_fetch_add(&verify->candidates, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(verify->collisions + (diff ? stdc_leading_zeros_ull(diff) : 64 - 8), 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (count) __atomic_fetch_add(&verify->hits, 1, __ATOMIC_RELAXED);
+
+	return count;
+}
+
+/* Hash store, remembering the position next to the entry */
+static void hash_store_verify(const HashTable *hashtable, const Key *key, const int depth, const uint64_t count, const Board *board) {
+	Hash *hash = hash_store_entry(hashtable, key, depth, count);
+
+	if (hash) position_set(hashtable->verify->position + (hash - hashtable->hash), board);
+}
+
+/* Report the false matches found for each number of stored code bits */
+void hash_verify_report(const HashTable *hashtable, FILE *output) {
+	const HashVerify *verify = hashtable->verify;
+	const int stored = 64 - stdc_count_ones_ull(GENERATION_MASK);
+	uint64_t n = 0;
+
+	fprintf(output, "hash verification: %llu entries (%.1f index bits), %llu probes, %llu hits, %llu other positions of the same depth probed\n",
+		(unsigned long long) hash_entries(hashtable), log2((double) hashtable->size), (unsigned long long) verify->probes,
+		(unsigned long long) verify->hits, (unsigned long long) verify->candidates);
+	fprintf(output, "  code bits   false matches   per probe     expected\n");
+	for (int bits = stored; bits >= 8; --bits) {
+		n += verify->collisions[bits];
+		if (bits % 8 == 0 || bits == stored) {
+			fprintf(output, "  %9d %15llu   %9.3e   %9.3e\n", bits, (unsigned long long) n, (double) n / (verify->probes + !verify->probes),
+				(double) verify->candidates / (verify->probes + !verify->probes) / (double) (1ull << (bits < 64 ? bits : 63)));
+		}
+	}
+}
+
+/* Numa topology: read it from /sys, or simulate <n_nodes> nodes over the available cpus */
+void numa_init(Numa *numa, const int n_nodes) {
+	char path[64];
+	FILE *file;
+	int node, first, last, x, n;
+
+	numa->n_cpus = numa->n_nodes = 0;
+	numa->simulated = (n_nodes > 0);
+#if defined(__linux__)
+	for (node = 0; !numa->simulated && node < NODE_SIZE; ++node) {
+		snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", node);
+		if ((file = fopen(path, "r")) == NULL) continue;
+		while ((n = fscanf(file, "%d-%d", &first, &last)) >= 1) {
+			if (n == 1) last = first;
+			for (x = first; x <= last && numa->n_cpus < CPU_SIZE; ++x) {
+				numa->cpu[numa->n_cpus] = x;
+				numa->node[numa->n_cpus++] = node;
+			}
+			if (fgetc(file) != ',') break;
+		}
+		fclose(file);
+		numa->n_nodes = node + 1;
+	}
+#else
+	(void) path; (void) file; (void) first; (void) last;
+#endif
+	// no topology found, or simulated one: spread the cpus evenly over the nodes
+	if (numa->n_cpus == 0) {
+	#if defined(__unix__) || defined(__APPLE__)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	#else
+		n = 1;
+	#endif
+		if (n < 1) n = 1;
+		if (n > CPU_SIZE) n = CPU_SIZE;
+		numa->n_nodes = numa->simulated ? (n_nodes < NODE_SIZE ? n_nodes : NODE_SIZE) : 1;
+		for (x = 0; x < n; ++x) {
+			numa->cpu[x] = x;
+			numa->node[x] = x * numa->n_nodes / n;
+		}
+		numa->n_cpus = n;
+	}
+}
+
+/* Cpu index assigned to a worker thread: compact fills a node before the next one, scatter cycles over the nodes */
+static int numa_cpu(const Numa *numa, const int worker) {
+	const int node = worker % numa->n_nodes;
+	int i, n = 0, rank;
+
+	if (numa->affinity != AFFINITY_SCATTER) return worker % numa->n_cpus;
+	for (i = 0; i < numa->n_cpus; ++i) n += (numa->node[i] == node);
+	if (n == 0) return worker % numa->n_cpus;
+	rank = (worker / numa->n_nodes) % n;
+	for (i = 0; i < numa->n_cpus; ++i) {
+		if (numa->node[i] == node && rank-- == 0) break;
+	}
+	return i;
+}
+
+/* Pin the calling thread on the cpu assigned to a worker */
+void numa_pin(const Numa *numa, const int worker) {
+#if defined(__linux__)
+	cpu_set_t set;
+
+	if (numa->affinity == AFFINITY_NONE) return;
+	CPU_ZERO(&set);
+	CPU_SET(numa->cpu[numa_cpu(numa, worker)], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#else
+	(void) numa; (void) worker;
+#endif
+}
+
+/* Pin the current thread to the cpus of a node */
+static void numa_pin_node(const Numa *numa, const int node) {
+#if defined(__linux__)
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	for (int i = 0; i < numa->n_cpus; ++i) if (numa->node[i] == node) CPU_SET(numa->cpu[i], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+#else
+	(void) numa; (void) node;
+#endif
+}
+
+/* Part of the hashtable of a node, when partitioned: a view of the node's own slice of the entries */
+static void hash_partition(const HashTable *hashtable, const Numa *numa, const int node, HashTable *part) {
+	const size_t n = hash_entries(hashtable), first = n * node / numa->n_nodes, last = n * (node + 1) / numa->n_nodes;
+
+	*part = *hashtable;
+	if (last - first < 2 * (size_t) BUCKET_SIZE) return;
+	if (part->stats) part->stats += first;
+	else part->hash += first;
+	part->size = last - first - BUCKET_SIZE;
+}
+
+#if defined(__linux__)
+typedef struct NumaChunk {
+	const Numa *numa;
+	char *start;
+	size_t size;
+	int node;
+} NumaChunk;
+
+/* Bind a memory area to some nodes. Silently ignored on simulated topologies or without kernel support. */
+static void numa_bind(const Numa *numa, char *start, char *end, const int mode, const uint64_t nodes) {
+	const uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t a = ((uintptr_t) start + page - 1) & ~(page - 1), b = (uintptr_t) end & ~(page - 1);
+
+	if (!numa->simulated && a < b) syscall(SYS_mbind, (void*) a, b - a, mode, &nodes, NODE_SIZE + 1, 0);
+}
+
+/* First touch a chunk of memory from a cpu of its node */
+static void* numa_touch(void *data) {
+	NumaChunk *chunk = data;
+
+	numa_pin_node(chunk->numa, chunk->node);
+	memset(chunk->start, 0, chunk->size);
+
+	return NULL;
+}
+#endif
+
+/* Place the hashtable memory over the numa nodes, before its first touch */
+void hash_place(HashTable *hashtable, const Numa *numa) {
+#if defined(__linux__)
+	enum { MPOL_PREFERRED = 1, MPOL_INTERLEAVE = 3 };
+	char *start = hashtable->stats ? (char*) hashtable->stats : (char*) hashtable->hash;
+	const size_t size = hash_bytes(hashtable), n = hash_entries(hashtable), entry_size = size / n;
+	NumaChunk chunk[NODE_SIZE];
+	pthread_t thread[NODE_SIZE];
+	int i;
+
+	if (numa->policy == NUMA_INTERLEAVE) {
+		numa_bind(numa, start, start + size, MPOL_INTERLEAVE, numa->n_nodes < 64 ? (1ull << numa->n_nodes) - 1 : -1ull);
+		memory_zero(start, size);
+	} else if (numa->policy == NUMA_PARTITION) {
+		for (i = 0; i < numa->n_nodes; ++i) {
+			chunk[i].numa = numa;
+			chunk[i].node = i;
+			// the same slices of entries as hash_partition()
+			chunk[i].start = start + entry_size * (n * i / numa->n_nodes);
+			chunk[i].size = entry_size * (n * (i + 1) / numa->n_nodes - n * i / numa->n_nodes);
+			numa_bind(numa, chunk[i].start, chunk[i].start + chunk[i].size, MPOL_PREFERRED, 1ull << i);
+			if (pthread_create(thread + i, NULL, numa_touch, chunk + i)) numa_touch(chunk + i), thread[i] = 0;
+		}
+		for (i = 0; i < numa->n_nodes; ++i) if (thread[i]) pthread_join(thread[i], NULL);
+	}
+#else
+	(void) hashtable; (void) numa;
+#endif
+}
+
+/* Report the placement of the hashtable pages, seen from the calling thread */
+void hash_numa_report(const HashTable *hashtable, const Numa *numa, FILE *output) {
+	enum { N_SAMPLES = 4096 };
+	char *start = hashtable->stats ? (char*) hashtable->stats : (char*) hashtable->hash;
+	const size_t size = hash_bytes(hashtable);
+	unsigned long long count[NODE_SIZE + 1] = {0}, local = 0, n = 0;
+	int i, node, here = 0;
+	bool known = false;
+	void *pages[N_SAMPLES];
+	int status[N_SAMPLES];
+
+#if defined(__linux__)
+	const int cpu = sched_getcpu();
+	for (i = 0; i < numa->n_cpus; ++i) if (numa->cpu[i] == cpu) here = numa->node[i];
+	for (i = 0; i < N_SAMPLES; ++i) pages[i] = start + (size / N_SAMPLES) * i;
+	known = !numa->simulated && syscall(SYS_move_pages, 0, N_SAMPLES, pages, NULL, status, 0) == 0;
+#endif
+	// no kernel information: use the intended placement
+	for (i = 0; !known && i < N_SAMPLES; ++i) {
+		if (numa->policy == NUMA_PARTITION) status[i] = i * numa->n_nodes / N_SAMPLES;
+		else if (numa->policy == NUMA_INTERLEAVE) status[i] = i % numa->n_nodes;
+		else status[i] = here;
+	}
+	for (i = 0; i < N_SAMPLES; ++i) {
+		node = status[i];
+		if (node < 0 || node >= NODE_SIZE) node = NODE_SIZE;
+		++count[node]; ++n;
+		if (node == here) ++local;
+	}
+	fprintf(output, "numa: %d node(s)%s, %d cpu(s); hashtable pages: %.1f%% local, %.1f%% remote (node %d);", numa->n_nodes, numa->simulated ? " simulated" : "", numa->n_cpus, 100.0 * local / n, 100.0 * (n - local) / n, here);
+	for (i = 0; i < numa->n_nodes && i < NODE_SIZE; ++i) fprintf(output, " node%d: %.1f%%", i, 100.0 * count[i] / n);
+	if (count[NODE_SIZE]) fprintf(output, " unknown: %.1f%%", 100.0 * count[NODE_SIZE] / n);
+	fputc('\n', output);
+}
+
+/* Add a subtree count to a 64-bit count, saturating to UINT64_MAX on overflow */
+static inline uint64_t count_add(uint64_t count, const uint64_t n) {
+	if (ckd_add(&count, count, n)) return UINT64_MAX;
+	return count;
+}
+
+/* Convert a 128-bit count to a string */
+char* count_to_string(Count count, char *s) {
+	static _Thread_local char string[48];
+	char buffer[48], *b = buffer;
+
+	if (s == NULL) s = string;
+	do {
+		*b++ = '0' + (int) (count % 10);
+		count /= 10;
+	} while (count);
+	for (char *t = s; b > buffer; ) *t++ = *--b, *t = '\0';
+
+	return s;
+}
+
+/* Add statistics */
+static inline void stats_add(Stats *stats, const Stats *s) {
+	stats->leaves += s->leaves;
+	stats->captures += s->captures;
+	stats->enpassants += s->enpassants;
+	stats->castles += s->castles;
+	stats->promotions += s->promotions;
+	stats->checks += s->checks;
+	stats->discovery_checks += s->discovery_checks;
+	stats->double_checks += s->double_checks;
+	stats->checkmates += s->checkmates;
+}
+
+/* Print statistics */
+void stats_print(const Stats *stats, FILE *output) {
+	fprintf(output, "  captures       : %15llu\n", (unsigned long long) stats->captures);
+	fprintf(output, "  en passant     : %15llu\n", (unsigned long long) stats->enpassants);
+	fprintf(output, "  castles        : %15llu\n", (unsigned long long) stats->castles);
+	fprintf(output, "  promotions     : %15llu\n", (unsigned long long) stats->promotions);
+	fprintf(output, "  checks         : %15llu\n", (unsigned long long) stats->checks);
+	fprintf(output, "  discovery check: %15llu\n", (unsigned long long) stats->discovery_checks);
+	fprintf(output, "  double checks  : %15llu\n", (unsigned long long) stats->double_checks);
+	fprintf(output, "  checkmates     : %15llu\n", (unsigned long long) stats->checkmates);
+}
+
+/* Prepare the check detection of the moves of the player to move */
+static void checkinfo_init(CheckInfo *ci, const Board *board) {
+	const Color c = board->player;
+	const Color o = opponent(c);
+	const Square k = board->x_king[o];
+	const Bitboard occupied = board->color[WHITE] + board->color[BLACK];
+	Bitboard b;
+
+	ci->king = k;
+	ci->bq = (board->piece[BISHOP] | board->piece[QUEEN]) & board->color[c];
+	ci->rq = (board->piece[ROOK] | board->piece[QUEEN]) & board->color[c];
+
+	// squares from where a piece gives a direct check
+	ci->check[PAWN] = MASK[k].pawn_attack[o];
+	ci->check[KNIGHT] = MASK[k].knight;
+	ci->check[BISHOP] = bishop_attack(occupied, k, -1ull);
+	ci->check[ROOK] = rook_attack(occupied, k, -1ull);
+	ci->check[QUEEN] = ci->check[BISHOP] | ci->check[ROOK];
+	ci->check[KING] = 0;
+
+	// pieces that may give a discovered check
+	ci->discover = 0;
+	b = ci->check[BISHOP] & board->color[c];
+	if (b) {
+		b = bishop_attack(occupied ^ b, k, ci->bq);
+		while (b) ci->discover |= BETWEEN[square_next(&b)][k] & board->color[c];
+	}
+	b = ci->check[ROOK] & board->color[c];
+	if (b) {
+		b = rook_attack(occupied ^ b, k, ci->rq);
+		while (b) ci->discover |= BETWEEN[square_next(&b)][k] & board->color[c];
+	}
+}
+
+/* Count a check and test if it is a checkmate */
+static inline void stats_check(Stats *stats, const Board *board, const Move move, const Bitboard checkers, const Bitboard direct) {
+	Board next;
+
+	++stats->checks;
+	if (!stdc_has_single_bit_ull(checkers)) ++stats->double_checks;
+	else if (checkers & ~direct) ++stats->discovery_checks;
+	board_copymake(board, move, &board->key, &next);
+	if (generate_moves(&next, NULL, false, true) == 0) ++stats->checkmates;
+}
+
+/* Classify a single move */
+static void stats_move(Stats *stats, const Board *board, const CheckInfo *ci, const Move move) {
+	const Square from = move_from(move);
+	const Square to = move_to(move);
+	const Bitboard b_from = square_to_bit(from);
+	const Bitboard b_to = square_to_bit(to);
+	const Piece p = board_piece(board, from);
+	Bitboard checkers, direct, pieces;
+	Board next;
+
+	++stats->leaves;
+	if (board->color[opponent(board->player)] & b_to) ++stats->captures;
+
+	// special moves: play them to find checks
+	if (move_promotion(move) || (p == PAWN && to == board->enpassant) || (p == KING && abs(to - from) == 2)) {
+		direct = b_to;
+		if (move_promotion(move)) ++stats->promotions;
+		else if (p == PAWN) {
+			++stats->captures;
+			++stats->enpassants;
+		} else {
+			++stats->castles;
+			direct = square_to_bit((from + to) / 2);
+		}
+		board_copymake(board, move, &board->key, &next);
+		checkers = next.checkers;
+	// usual moves: direct & discovered checks
+	} else {
+		checkers = direct = ci->check[p] & b_to;
+		if (ci->discover & b_from) {
+			pieces = (board->color[WHITE] + board->color[BLACK] - b_from) | b_to;
+			checkers |= bishop_attack(pieces, ci->king, ci->bq & ~b_from) | rook_attack(pieces, ci->king, ci->rq & ~b_from);
+		}
+	}
+
+	if (checkers) stats_check(stats, board, move, checkers, direct);
+}
+
+/* Classify the moves of a piece, in bulk unless it may give a discovered check */
+static inline void stats_moves(Stats *stats, const Board *board, const CheckInfo *ci, Bitboard attack, const Square from, const Piece p) {
+	Bitboard b;
+	Square to;
+
+	if (ci->discover & square_to_bit(from)) {
+		while (attack) {
+			to = square_next(&attack);
+			stats_move(stats, board, ci, from | (to << 6));
+		}
+	} else {
+		stats->leaves += stdc_count_ones_ull(attack);
+		stats->captures += stdc_count_ones_ull(attack & (board->color[WHITE] + board->color[BLACK]));
+		b = attack & ci->check[p];
+		while (b) {
+			to = square_next(&b);
+			stats_check(stats, board, from | (to << 6), square_to_bit(to), square_to_bit(to));
+		}
+	}
+}
+
+/* Classify the pawn moves from a direction, in bulk unless they promote or may give a discovered check */
+static inline void stats_pawn_moves(Stats *stats, const Board *board, const CheckInfo *ci, Bitboard attack, const int dir) {
+	const Bitboard discover = ci->discover & board->piece[PAWN];
+	Bitboard b;
+	Square to;
+
+	b = attack & (PROMOTION_RANK[board->player] | (board->player ? discover >> -dir : discover << dir));
+	attack ^= b;
+	while (b) {
+		to = square_next(&b);
+		if (square_to_bit(to) & PROMOTION_RANK[board->player]) {
+			stats_move(stats, board, ci, (to - dir) | (to << 6) | QUEEN_PROMOTION);
+			stats_move(stats, board, ci, (to - dir) | (to << 6) | KNIGHT_PROMOTION);
+			stats_move(stats, board, ci, (to - dir) | (to << 6) | ROOK_PROMOTION);
+			stats_move(stats, board, ci, (to - dir) | (to << 6) | BISHOP_PROMOTION);
+		} else stats_move(stats, board, ci, (to - dir) | (to << 6));
+	}
+	stats->leaves += stdc_count_ones_ull(attack);
+	stats->captures += stdc_count_ones_ull(attack & board->color[opponent(board->player)]);
+	b = attack & ci->check[PAWN];
+	while (b) {
+		to = square_next(&b);
+		stats_check(stats, board, (to - dir) | (to << 6), square_to_bit(to), square_to_bit(to));
+	}
+}
+
+/* Classify all the moves of a position, mostly with bitboard arithmetic.
+ * It follows generate_moves(), but only the moves giving check (to detect
+ * checkmates), the special moves (castling, enpassant, promotion) or the moves
+ * of the pieces that may discover a check are looked at individually.
+ */
+static void stats_generate(Board *board, const bool do_quiet, Stats *stats) {
+	const Color c = board->player;
+	const Color o = opponent(c);
+	const Bitboard occupied = board->color[WHITE] + board->color[BLACK];
+	const Bitboard bq = board->piece[BISHOP] | board->piece[QUEEN];
+	const Bitboard rq = board->piece[ROOK] | board->piece[QUEEN];
+	const Bitboard pinned = board->pinned;
+	const Bitboard unpinned = board->color[c] & ~pinned;
+	const Square k = board->x_king[c];
+	const int pawn_left = PUSH[c] - 1;
+	const int pawn_right = PUSH[c] + 1;
+	const int pawn_push = PUSH[c];
+	const Bitboard empty = ~occupied;
+	const Bitboard enemy = board->color[o];
+	const Bitboard target = do_quiet ? enemy | empty : enemy;
+	Bitboard piece, attack, attacked, castle;
+	CheckInfo ci;
+	MoveArray ma;
+	Move move;
+	Square from, to;
+
+	checkinfo_init(&ci, board);
+
+	// in check: few evasions, classify them one by one
+	if (board->checkers) {
+		movearray_generate(&ma, board, true);
+		while ((move = movearray_next(&ma)) != 0) stats_move(stats, board, &ci, move);
+		return;
+	}
+
+	// pinned pieces, enpassant & king: few moves, classify them one by one
+	if (pinned || board_enpassant(board)) {
+		movearray_generate(&ma, board, do_quiet);
+		while ((move = movearray_next(&ma)) != 0) {
+			from = move_from(move);
+			if ((square_to_bit(from) & pinned) || (move_to(move) == board->enpassant && (board->piece[PAWN] & square_to_bit(from)))) {
+				stats_move(stats, board, &ci, move);
+			}
+		}
+	}
+
+	// king & castling, out of the squares attacked by the opponent
+	attack = king_attack(k, target);
+	castle = do_quiet ? board_castle(board, c, occupied) : 0;
+	if (attack | castle) {
+		attacked = board_attack(board, o);
+		attack = (attack & ~attacked) | board_castle_safe(castle, k, attacked);
+		while (attack) {
+			to = square_next(&attack);
+			stats_move(stats, board, &ci, k | (to << 6));
+		}
+	}
+
+	// pawn
+	piece = board->piece[PAWN] & unpinned;
+	stats_pawn_moves(stats, board, &ci, (c ? (piece & ~COLUMN[0]) >> 9 : (piece & ~COLUMN[0]) << 7) & enemy, pawn_left);
+	stats_pawn_moves(stats, board, &ci, (c ? (piece & ~COLUMN[7]) >> 7 : (piece & ~COLUMN[7]) << 9) & enemy, pawn_right);
+	attack = (c ? piece >> 8 : piece << 8) & empty;
+	stats_pawn_moves(stats, board, &ci, attack & (do_quiet ? -1ull : PROMOTION_RANK[c]), pawn_push);
+	if (do_quiet) {
+		attack = (c ? (((piece & RANK[6]) >> 8) & empty) >> 8 : (((piece & RANK[1]) << 8) & empty) << 8) & empty;
+		stats_pawn_moves(stats, board, &ci, attack, 2 * pawn_push);
+	}
+
+	// knight
+	piece = board->piece[KNIGHT] & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stats_moves(stats, board, &ci, knight_attack(from, target), from, KNIGHT);
+	}
+
+	// bishop or queen
+	piece = bq & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stats_moves(stats, board, &ci, bishop_attack(occupied, from, target), from, board_piece(board, from));
+	}
+
+	// rook or queen
+	piece = rq & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stats_moves(stats, board, &ci, rook_attack(occupied, from, target), from, board_piece(board, from));
+	}
+}
+
+/* Count the moves after a move, for a child whose leaves are only counted: the board is played without its key,
+ * & its checkers are found from the move */
+static inline int leaf_count(const Board *board, const Square from, const Square to, const Piece p, const Piece promotion, const bool do_quiet) {
+	Board next;
+
+	board_play(board, from, to, p, promotion, &board->key, &next);
+	generate_checkers_move(&next, to, promotion ? promotion : p);
+
+	return generate_moves(&next, NULL, false, do_quiet || next.checkers);
+}
+
+/* Leaf batches: the children of a depth-2 node are played into a block & counted BATCH_SIZE at a time (AVX-512).
+ * Each bitboard of the block is a vector holding one lane per child (GCC vector extensions), and the moves
+ * are counted as sets, direction by direction: Kogge-Stone fills give the slider moves, whose destinations
+ * in a direction are distinct for distinct pieces. A child in check, with a pinned piece or an en passant is
+ * counted by generate_moves().
+ */
+#if defined(__GNUC__) && defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__) && !defined(NO_LEAF_BATCH)
+	#define USE_LEAF_BATCH 1
+#endif
+
+#if defined(USE_LEAF_BATCH)
+
+typedef uint64_t Lanes __attribute__((vector_size(BATCH_SIZE * sizeof (uint64_t))));
+
+typedef struct LeafBatch {
+	Lanes piece[PIECE_SIZE];
+	Lanes color[COLOR_SIZE]; // the player to move, then its opponent
+	Bitboard castle[BATCH_SIZE];
+	uint8_t from[BATCH_SIZE], to[BATCH_SIZE], p[BATCH_SIZE], promotion[BATCH_SIZE];
+	const Board *board;
+	unsigned slow;
+	int n;
+} LeafBatch;
+
+/* Shift all lanes toward a direction */
+static inline Lanes lanes_shift(const Lanes b, const int s) {
+	return s > 0 ? b << s : b >> -s;
+}
+
+/* Squares not wrapping around the board when shifted toward a direction */
+static inline Bitboard shift_wrap(const int s) {
+	const int f = (s + 64) % 8; // file increment: 1, 2, 6, 7 or 0
+
+	if (f == 1) return ~COLUMN[0];
+	if (f == 2) return ~(COLUMN[0] | COLUMN[1]);
+	if (f == 6) return ~(COLUMN[6] | COLUMN[7]);
+	if (f == 7) return ~COLUMN[7];
+	return -1ull;
+}
+
+/* Squares one step away toward a direction */
+static inline Lanes lanes_step(const Lanes b, const int s) {
+	return lanes_shift(b, s) & shift_wrap(s);
+}
+
+/* Squares attacked toward a direction by sliders, up to the first occupied square (Kogge-Stone fill) */
+static inline Lanes lanes_ray(Lanes slider, Lanes empty, const int s) {
+	const Bitboard wrap = shift_wrap(s);
+
+	empty &= wrap;
+	slider |= empty & lanes_shift(slider, s);
+	empty &= lanes_shift(empty, s);
+	slider |= empty & lanes_shift(slider, 2 * s);
+	empty &= lanes_shift(empty, 2 * s);
+	slider |= empty & lanes_shift(slider, 4 * s);
+	return lanes_shift(slider, s) & wrap;
+}
+
+/* Count the squares of each lane */
+static inline Lanes lanes_count(const Lanes b) {
+	return (Lanes) _mm512_popcnt_epi64((__m512i) b);
+}
+
+/* Squares attacked by knights */
+static inline Lanes lanes_knight(const Lanes b) {
+	return lanes_step(b, 17) | lanes_step(b, 15) | lanes_step(b, 10) | lanes_step(b, 6) | lanes_step(b, -6) | lanes_step(b, -10) | lanes_step(b, -15) | lanes_step(b, -17);
+}
+
+/* Squares attacked by kings */
+static inline Lanes lanes_king(const Lanes b) {
+	return lanes_step(b, 9) | lanes_step(b, 8) | lanes_step(b, 7) | lanes_step(b, 1) | lanes_step(b, -1) | lanes_step(b, -7) | lanes_step(b, -8) | lanes_step(b, -9);
+}
+
+/* Squares attacked by pawns of a color */
+static inline Lanes lanes_pawn(const Lanes b, const Color c) {
+	return c ? lanes_step(b, -9) | lanes_step(b, -7) : lanes_step(b, 7) | lanes_step(b, 9);
+}
+
+/* Start a batch of the children of a board */
+static inline void batch_init(LeafBatch *batch, const Board *board) {
+	batch->board = board;
+	batch->slow = 0;
+	batch->n = 0;
+}
+
+/* Play a move of the board into the next lane of the batch, like board_play(). */
+static inline void batch_play(LeafBatch *batch, const Square from, const Square to, const Piece p, const Piece promotion) {
+	const Board *board = batch->board;
+	const Color c = board->player;
+	const Color o = opponent(c);
+	const Bitboard b_from = square_to_bit(from);
+	const Bitboard b_to = square_to_bit(to);
+	const int i = batch->n;
+	Bitboard piece[PIECE_SIZE], C = board->color[c] ^ (b_from | b_to), O = board->color[o], b;
+
+	for (int q = PAWN; q < PIECE_SIZE; ++q) piece[q] = board->piece[q];
+	// capture
+	if (O & b_to) {
+		piece[board_piece(board, to)] ^= b_to;
+		O ^= b_to;
+	}
+	// move the piece
+	piece[p] ^= b_from | b_to;
+	// special pawn move
+	if (p == PAWN) {
+		if (promotion) {
+			piece[PAWN] ^= b_to;
+			piece[promotion] ^= b_to;
+		} else if (board->enpassant == to) {
+			b = square_to_bit(square(file(to), rank(from)));
+			piece[PAWN] ^= b;
+			O ^= b;
+		} else if (abs(to - from) == 16 && (MASK[to].enpassant & O & piece[PAWN])) {
+			batch->slow |= 1u << i;
+		}
+	// king move
+	} else if (p == KING) {
+		if (to == from + 2) b = square_to_bit(from + 3) | square_to_bit(from + 1);
+		else if (to == from - 2) b = square_to_bit(from - 4) | square_to_bit(from - 1);
+		else b = 0;
+		piece[ROOK] ^= b;
+		C ^= b;
+	}
+
+	for (int q = PAWN; q < PIECE_SIZE; ++q) batch->piece[q][i] = piece[q];
+	batch->color[0][i] = O;
+	batch->color[1][i] = C;
+	batch->castle[i] = castle_candidates(board->castling & MASK_CASTLING[from] & MASK_CASTLING[to], o, board->x_king[o], C | O);
+	batch->from[i] = from;
+	batch->to[i] = to;
+	batch->p[i] = p;
+	batch->promotion[i] = promotion;
+	batch->n = i + 1;
+}
+
+/* Count the legal moves of the children in the batch & empty it */
+static uint64_t batch_count(LeafBatch *batch) {
+	static const int diagonal[] = {9, 7, -7, -9}, orthogonal[] = {8, 1, -1, -8}, knight[] = {17, 15, 10, 6, -6, -10, -15, -17};
+	const Board *board = batch->board;
+	const Color c = opponent(board->player);
+	const Color o = board->player;
+	const Square k = board->x_king[c];
+	const int push = c ? -8 : 8;
+	const Lanes pawn = batch->piece[PAWN], knights = batch->piece[KNIGHT], king = batch->piece[KING];
+	const Lanes bq = batch->piece[BISHOP] | batch->piece[QUEEN], rq = batch->piece[ROOK] | batch->piece[QUEEN];
+	const Lanes C = batch->color[0], O = batch->color[1];
+	const Lanes empty = ~(C | O), target = ~C;
+	Lanes check, pin, ray, attacked, count, b;
+	uint64_t total = 0;
+	int i;
+
+	// checkers & pinned pieces, from the king
+	b = king & C;
+	check = (lanes_knight(b) & knights & O) | (lanes_pawn(b, c) & pawn & O);
+	pin = (Lanes) {0};
+	for (i = 0; i < 4; ++i) {
+		ray = lanes_ray(b, empty, diagonal[i]);
+		check |= ray & bq & O;
+		pin |= lanes_ray(ray & C, empty, diagonal[i]) & bq & O;
+		ray = lanes_ray(b, empty, orthogonal[i]);
+		check |= ray & rq & O;
+		pin |= lanes_ray(ray & C, empty, orthogonal[i]) & rq & O;
+	}
+
+	// squares attacked by the opponent, seen through the king
+	attacked = lanes_pawn(pawn & O, o) | lanes_knight(knights & O) | lanes_king(king & O);
+	for (i = 0; i < 4; ++i) {
+		attacked |= lanes_ray(bq & O, empty | b, diagonal[i]);
+		attacked |= lanes_ray(rq & O, empty | b, orthogonal[i]);
+	}
+
+	// king, knights & sliders
+	count = lanes_count(lanes_king(b) & target & ~attacked);
+	for (i = 0; i < 8; ++i) count += lanes_count(lanes_step(knights & C, knight[i]) & target);
+	for (i = 0; i < 4; ++i) {
+		count += lanes_count(lanes_ray(bq & C, empty, diagonal[i]) & target);
+		count += lanes_count(lanes_ray(rq & C, empty, orthogonal[i]) & target);
+	}
+
+	// pawns
+	b = pawn & C;
+	ray = lanes_shift(b, push) & empty;
+	count += lanes_count(ray & ~PROMOTION_RANK[c]) + (lanes_count(ray & PROMOTION_RANK[c]) << 2);
+	count += lanes_count(lanes_shift(ray & RANK[c ? 5 : 2], push) & empty);
+	ray = lanes_step(b, push - 1) & O;
+	count += lanes_count(ray & ~PROMOTION_RANK[c]) + (lanes_count(ray & PROMOTION_RANK[c]) << 2);
+	ray = lanes_step(b, push + 1) & O;
+	count += lanes_count(ray & ~PROMOTION_RANK[c]) + (lanes_count(ray & PROMOTION_RANK[c]) << 2);
+
+	// sum the lanes, or replay & count the slow children one by one
+	check |= pin;
+	for (i = 0; i < batch->n; ++i) {
+		if ((batch->slow & (1u << i)) || check[i]) total += leaf_count(board, batch->from[i], batch->to[i], batch->p[i], batch->promotion[i], true); else total += count[i] + stdc_count_ones_ull(board_castle_safe(batch->castle[i], k, attacked[i]));
+	}
+	batch_init(batch, board);
+
+	return total;
+}
+
+#endif
+
+/* Recursive Perft with optional hashtable, bulk counting & capture only generation */
+uint64_t perft(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	Board next;
+	uint64_t count = 0, hash_count;
+	Move move;
+	MoveArray ma;
+	const bool use_key = (hashtable && depth > hashtable->key_depth);
+	const bool use_hash = (use_key && hashtable->policy[depth - 1] != HASH_OFF);
+	Key key = board->key;
+#if defined(USE_LEAF_BATCH)
+	LeafBatch batch;
+
+	// a batch of leaves for the full count of a depth-2 node whose children are not hashed
+	if (bulk && depth == 2 && do_quiet && !use_hash) {
+		movearray_generate(&ma, board, true);
+		batch_init(&batch, board);
+		while ((move = movearray_next(&ma)) != 0) {
+			batch_play(&batch, move_from(move), move_to(move), board_piece(board, move_from(move)), move_promotion(move));
+			if (batch.n == BATCH_SIZE) count += batch_count(&batch);
+		}
+		return batch.n ? count + batch_count(&batch) : count;
+	}
+#endif
+
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+	// the leaves are only counted
+	if (depth == 1) return ma.n;
+
+	while ((move = movearray_next(&ma)) != 0) {
+		if (use_key) {
+			key_update(&key, board, move);
+			if (hashtable->policy[depth - 1] == HASH_MAIN) hash_prefetch(hashtable, &key);
+		}
+		// a child whose leaves are only counted is played after the probe, when it misses
+		if (bulk && depth == 2) {
+			hash_count = use_hash ? hash_probe_policy(hashtable, &key, depth - 1) : 0;
+			if (hash_count == 0) {
+				hash_count = leaf_count(board, move_from(move), move_to(move), board_piece(board, move_from(move)), move_promotion(move), do_quiet);
+				if (use_hash) hash_store_policy(hashtable, &key, depth - 1, hash_count);
+			}
+			count += hash_count;
+			continue;
+		}
+		board_copymake(board, move, &key, &next);
+		if (use_hash) {
+			hash_count = hash_probe_policy(hashtable, &key, depth - 1);
+			if (hash_count == 0) {
+				hash_count = perft(&next, hashtable, depth - 1, bulk, do_quiet);
+				hash_store_policy(hashtable, &key, depth - 1, hash_count);
+			}
+			count = count_add(count, hash_count);
+		} else count = count_add(count, perft(&next, hashtable, depth - 1, bulk, do_quiet));
+	}
+
+	return count;
+}
+
+/* Recursive Perft checking the hashtable against false matches */
+uint64_t perft_verify(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	Board next;
+	uint64_t count = 0, hash_count;
+	Move move;
+	MoveArray ma;
+	Key key;
+
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+	// the leaves are only counted
+	if (depth == 1) return ma.n;
+
+	while ((move = movearray_next(&ma)) != 0) {
+		key_update(&key, board, move);
+		board_copymake(board, move, &key, &next);
+		if (bulk && depth == 2) count += generate_moves(&next, NULL, false, do_quiet || next.checkers);
+		else if (depth == 2) count = count_add(count, perft_verify(&next, hashtable, depth - 1, bulk, do_quiet));
+		else {
+			hash_count = hash_probe_verify(hashtable, &key, depth - 1, &next);
+			if (hash_count == 0) {
+				hash_count = perft_verify(&next, hashtable, depth - 1, bulk, do_quiet);
+				hash_store_verify(hashtable, &key, depth - 1, hash_count, &next);
+			}
+			count = count_add(count, hash_count);
+		}
+	}
+
+	return count;
+}
+
+/* Streaming perft state */
+typedef struct PerftStream {
+	const Board *board;
+	HashTable *hashtable;
+	uint64_t count;
+	int depth;
+	bool bulk;
+	bool do_quiet;
+	bool use_key;
+	bool use_hash;
+	bool use_small;
+#if defined(USE_LEAF_BATCH)
+	LeafBatch *batch;
+#endif
+} PerftStream;
+
+uint64_t perft_stream(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+
+/* Play a move as soon as it is generated & count its leaves */
+static void stream_move(PerftStream *ps, const Square from, const Square to, const Piece p, const Piece promotion) {
+	Board next;
+	Key key;
+	uint64_t count;
+
+	// a leaf is only counted
+	if (ps->depth == 1) {
+		++ps->count;
+		return;
+	}
+	if (ps->use_key) {
+		key_make(&key, ps->board, from, to, p, promotion);
+		if (ps->use_hash && !ps->use_small) hash_prefetch(ps->hashtable, &key);
+	}
+#if defined(USE_LEAF_BATCH)
+	if (ps->batch) {
+		batch_play(ps->batch, from, to, p, promotion);
+		if (ps->batch->n == BATCH_SIZE) ps->count += batch_count(ps->batch);
+		return;
+	}
+#endif
+	// a child whose leaves are only counted is played after the probe, when it misses
+	if (ps->bulk && ps->depth == 2) {
+		count = ps->use_hash ? hash_probe_policy(ps->hashtable, &key, 1) : 0;
+		if (count == 0) {
+			count = leaf_count(ps->board, from, to, p, promotion, ps->do_quiet);
+			if (ps->use_hash) hash_store_policy(ps->hashtable, &key, 1, count);
+		}
+		ps->count += count;
+		return;
+	}
+	board_make(ps->board, from, to, p, promotion, &key, &next);
+	if (ps->use_hash) {
+		count = hash_probe_policy(ps->hashtable, &key, ps->depth - 1);
+		if (count == 0) {
+			count = perft_stream(&next, ps->hashtable, ps->depth - 1, ps->bulk, ps->do_quiet);
+			hash_store_policy(ps->hashtable, &key, ps->depth - 1, count);
+		}
+		ps->count = count_add(ps->count, count);
+	} else ps->count = count_add(ps->count, perft_stream(&next, ps->hashtable, ps->depth - 1, ps->bulk, ps->do_quiet));
+}
+
+/* Play all moves from a square */
+static inline void stream_moves(PerftStream *ps, Bitboard attack, const Square from, const Piece p) {
+	while (attack) stream_move(ps, from, square_next(&attack), p, 0);
+}
+
+/* Play all pawn moves from a direction */
+static inline void stream_pawn_moves(PerftStream *ps, Bitboard attack, const int dir) {
+	Square to;
+
+	while (attack) {
+		to = square_next(&attack);
+		stream_move(ps, to - dir, to, PAWN, 0);
+	}
+}
+
+/* Play all promotions from a direction */
+static inline void stream_promotions(PerftStream *ps, Bitboard attack, const int dir) {
+	Square to;
+
+	while (attack) {
+		to = square_next(&attack);
+		stream_move(ps, to - dir, to, PAWN, QUEEN);
+		stream_move(ps, to - dir, to, PAWN, KNIGHT);
+		stream_move(ps, to - dir, to, PAWN, ROOK);
+		stream_move(ps, to - dir, to, PAWN, BISHOP);
+	}
+}
+
+/* Recursive Perft playing the moves while generating them, without building a move list.
+ * It follows generate_moves(), where the piece & the kind of each move are known.
+ */
+uint64_t perft_stream(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	const bool use_key = hashtable && depth > hashtable->key_depth;
+	const bool use_hash = use_key && hashtable->policy[depth - 1] != HASH_OFF;
+	PerftStream ps = {board, hashtable, 0, depth, bulk, do_quiet, use_key, use_hash, use_hash && hashtable->policy[depth - 1] == HASH_SMALL,
+#if defined(USE_LEAF_BATCH)
+		NULL
+#endif
+	};
+	const bool quiet = do_quiet || board->checkers;
+	const Color c = board->player;
+	const Color o = opponent(c);
+	const Bitboard occupied = board->color[WHITE] + board->color[BLACK];
+	const Bitboard pinned = board->pinned;
+	const Bitboard unpinned = board->color[c] & ~pinned;
+	const Bitboard checkers = board->checkers;
+	const Square k = board->x_king[c];
+	const int pawn_left = PUSH[c] - 1;
+	const int pawn_right = PUSH[c] + 1;
+	const int pawn_push = PUSH[c];
+	const int8_t *dir = DIRECTION[k];
+	Bitboard target, piece, attack, attacked, castle = 0;
+	Bitboard empty = ~occupied;
+	Bitboard enemy = board->color[o];
+	Square from, to, ep, x_checker = ENPASSANT_NONE;
+	int d;
+#if defined(USE_LEAF_BATCH)
+	LeafBatch batch;
+
+	// a batch of leaves for the full count of a depth-2 node whose children are not hashed
+	if (bulk && depth == 2 && do_quiet && !use_hash) {
+		batch_init(&batch, board);
+		ps.batch = &batch;
+	}
+#endif
+
+	// in check: capture or block the (single) checker if any;
+	if (checkers) {
+		if (stdc_has_single_bit_ull(checkers)) {
+			x_checker = square_first(checkers);
+			empty = BETWEEN[k][x_checker];
+			enemy = checkers;
+		} else {
+			empty = enemy  = 0;
+		}
+
+	// not in check: castling & pinned pieces moves
+	} else {
+		target = enemy; if (quiet) target |= empty;
+		// castling candidates, with an empty path
+		if (quiet) castle = board_castle(board, c, occupied);
+		// pawn (pinned)
+		piece = board->piece[PAWN] & pinned;
+		while (piece) {
+			from = square_next(&piece);
+			d = dir[from];
+			if (d == abs(pawn_left) && (square_to_bit(to = from + pawn_left) & pawn_attack(from, c, enemy))) {
+				if (is_on_seventh_rank(from, c)) stream_promotions(&ps, square_to_bit(to), pawn_left); else stream_move(&ps, from, to, PAWN, 0);
+			} else if (d == abs(pawn_right) && (square_to_bit(to = from + pawn_right) & pawn_attack(from, c, enemy))) {
+				if (is_on_seventh_rank(from, c)) stream_promotions(&ps, square_to_bit(to), pawn_right); else stream_move(&ps, from, to, PAWN, 0);
+			}
+			if (quiet && d == abs(pawn_push) && (square_to_bit(to = from + pawn_push) & empty)) {
+				stream_move(&ps, from, to, PAWN, 0);
+				if (is_on_second_rank(from, c) && (square_to_bit(to += pawn_push) & empty)) stream_move(&ps, from, to, PAWN, 0);
+			}
+		}
+		// bishop or queen (pinned)
+		piece = (board->piece[BISHOP] | board->piece[QUEEN]) & pinned;
+		while (piece) {
+			from = square_next(&piece);
+			d = dir[from];
+			attack = 0;
+			if (d == 9) attack = bishop_attack(occupied, from, target & LINE[from].diagonal);
+			else if (d == 7) attack = bishop_attack(occupied, from, target & LINE[from].antidiagonal);
+			stream_moves(&ps, attack, from, board_piece(board, from));
+		}
+		// rook or queen (pinned)
+		piece = (board->piece[ROOK] | board->piece[QUEEN]) & pinned;
+		while (piece) {
+			from = square_next(&piece);
+			d = dir[from];
+			attack = 0;
+			if (d == 1) attack = rook_attack(occupied, from, target & LINE[from].rank);
+			else if (d == 8) attack = rook_attack(occupied, from, target & LINE[from].file);
+			stream_moves(&ps, attack, from, board_piece(board, from));
+		}
+	}
+	// common moves
+
+	target = enemy; if (quiet) target |= empty;
+
+	// enpassant capture
+	if (board_enpassant(board) && (!checkers || x_checker == board->enpassant - pawn_push)) {
+		const Bitboard bq = (board->piece[BISHOP] | board->piece[QUEEN]) & board->color[o];
+		const Bitboard rq = (board->piece[ROOK] | board->piece[QUEEN]) & board->color[o];
+		to = board->enpassant;
+		ep = to - pawn_push;
+		from = ep - 1;
+		if (file(to) > 0 && (board->piece[PAWN] & board->color[c] & square_to_bit(from))) {
+			piece = occupied ^ square_to_bit(from) ^ square_to_bit(ep) ^ square_to_bit(to);
+			if (!bishop_attack(piece, k, bq) && !rook_attack(piece, k, rq)) stream_move(&ps, from, to, PAWN, 0);
+		}
+		from = ep + 1;
+		if (file(to) < 7 && (board->piece[PAWN] & board->color[c] & square_to_bit(from))) {
+			piece = occupied ^ square_to_bit(from) ^ square_to_bit(ep) ^ square_to_bit(to);
+			if (!bishop_attack(piece, k, bq) && !rook_attack(piece, k, rq)) stream_move(&ps, from, to, PAWN, 0);
+		}
+	}
+
+	// pawn
+	piece = board->piece[PAWN] & unpinned;
+	attack = (c ? (piece & ~COLUMN[0]) >> 9 : (piece & ~COLUMN[0]) << 7) & enemy;
+	stream_promotions(&ps, attack & PROMOTION_RANK[c], pawn_left);
+	stream_pawn_moves(&ps, attack & ~PROMOTION_RANK[c], pawn_left);
+
+	attack = (c ? (piece & ~COLUMN[7]) >> 7 : (piece & ~COLUMN[7]) << 9) & enemy;
+	stream_promotions(&ps, attack & PROMOTION_RANK[c], pawn_right);
+	stream_pawn_moves(&ps, attack & ~PROMOTION_RANK[c], pawn_right);
+
+	attack = (c ? piece >> 8 : piece << 8) & empty;
+	stream_promotions(&ps, attack & PROMOTION_RANK[c], pawn_push);
+	if (quiet) {
+		stream_pawn_moves(&ps, attack & ~PROMOTION_RANK[c], pawn_push);
+		attack = (c ? (((piece & RANK[6]) >> 8) & ~occupied) >> 8 : (((piece & RANK[1]) << 8) & ~occupied) << 8) & empty;
+		stream_pawn_moves(&ps, attack, 2 * pawn_push);
+	}
+
+	// knight
+	piece = board->piece[KNIGHT] & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stream_moves(&ps, knight_attack(from, target), from, KNIGHT);
+	}
+
+	// bishop
+	piece = board->piece[BISHOP] & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stream_moves(&ps, bishop_attack(occupied, from, target), from, BISHOP);
+	}
+
+	// rook
+	piece = board->piece[ROOK] & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stream_moves(&ps, rook_attack(occupied, from, target), from, ROOK);
+	}
+
+	// queen
+	piece = board->piece[QUEEN] & unpinned;
+	while (piece) {
+		from = square_next(&piece);
+		stream_moves(&ps, bishop_attack(occupied, from, target) | rook_attack(occupied, from, target), from, QUEEN);
+	}
+
+	// king & castling, out of the squares attacked by the opponent
+	target = board->color[o]; if (quiet) target |= ~occupied;
+	attack = king_attack(k, target);
+	if (attack | castle) {
+		attacked = board_attack(board, o);
+		stream_moves(&ps, (attack & ~attacked) | board_castle_safe(castle, k, attacked), k, KING);
+	}
+#if defined(USE_LEAF_BATCH)
+	if (ps.batch && batch.n) ps.count += batch_count(&batch);
+#endif
+
+	return ps.count;
+}
+
+/* Perft with 128-bit counts above <wide_depth>, handing the deeper plies over to the 64-bit engine. A 64-bit count
+ * saturated by an overflow is searched again, with 128-bit counts one ply deeper. */
+static Count perft_wide_depth(Board *board, HashTable *hashtable, const int depth, const int wide_depth, const bool bulk, const bool do_quiet) {
+	Board next;
+	Count count = 0, c;
+	Move move;
+	MoveArray ma;
+	Key key;
+
+	if (depth <= wide_depth) {
+		count = perft_stream(board, hashtable, depth, bulk, do_quiet);
+		if (count != UINT64_MAX || depth <= 2) return count;
+		return perft_wide_depth(board, hashtable, depth, depth - 1, bulk, do_quiet);
+	}
+
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+	while ((move = movearray_next(&ma)) != 0) {
+		key_update(&key, board, move);
+		board_copymake(board, move, &key, &next);
+		if (hashtable && hashtable->wide) {
+			if (!hash_probe_wide(hashtable, &key, depth - 1, &c)) {
+				c = perft_wide_depth(&next, hashtable, depth - 1, wide_depth, bulk, do_quiet);
+				hash_store_wide(hashtable, &key, depth - 1, c);
+			}
+		} else c = perft_wide_depth(&next, hashtable, depth - 1, wide_depth, bulk, do_quiet);
+		count += c;
+	}
+
+	return count;
+}
+
+/* Perft with 128-bit counts at the high depths, handing the deeper plies over to the 64-bit engine */
+Count perft_wide(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	return perft_wide_depth(board, hashtable, depth, WIDE_DEPTH, bulk, do_quiet);
+}
+
+/* Time of the fastest of a few short searches, from a cleared hashtable */
+static double adapt_time(HashTable *hashtable, Board *board, const int depth, const bool bulk, const bool do_quiet, uint64_t *count) {
+	double t, best = HUGE_VAL;
+
+	for (int i = 0; i < 3; ++i) {
+		hash_clear(hashtable);
+		t = -mperft_chrono();
+		*count = perft_stream(board, hashtable, depth, bulk, do_quiet);
+		t += mperft_chrono();
+		if (t < best) best = t;
+	}
+	return best;
+}
+
+/* Shrink a hashtable mask by <shift> bits, keeping at least 64 entries */
+static uint64_t adapt_mask(const uint64_t mask, int shift) {
+	const int bits = stdc_count_ones_ull(mask);
+
+	if (shift > bits - 6) shift = bits > 6 ? bits - 6 : 0;
+	return mask >> shift;
+}
+
+/* Shrink a hashtable size by <shift> bits, keeping at least 64 entries */
+static uint64_t adapt_size(const uint64_t size, const int shift) {
+	const uint64_t shrunk = shift < 64 ? size >> shift : 0;
+
+	return shrunk >= 64 ? shrunk : (size < 64 ? size : 64);
+}
+
+/* Adapt the hash policy to the position & the hashtable: at the low depths, where a probe may cost more than
+ * the subtree it saves, time short searches of the position with each mode & keep the fastest one.
+ * The short searches are about a thousand times smaller than the full search, which keeps the adaptation
+ * cost within a few percent. During them, the hashtables are shrunk by the ratio of the tree sizes, to be as
+ * loaded as in the full search. A mode replaces the current one only if it is clearly faster and if its saving,
+ * extrapolated to the full search, pays for the adaptation so far, so the fixed rule stays unless it loses. The
+ * trials stop when the next one would take the adaptation over 0.5% of the estimated full search time. */
+void hash_adapt(HashTable *hashtable, Board *board, const int depth, const bool bulk, const bool do_quiet, FILE *output) {
+	static const char *name[HASH_MODE_SIZE] = {"off", "main", "small"};
+	static const int order[] = {2, 3, 1};
+	const double gain = 0.90, budget = 0.005;
+	const uint64_t size = hashtable->size, small_mask = hashtable->small_mask;
+	double start = mperft_chrono(), t, time[HASH_MODE_SIZE], growth, ratio, cost;
+	uint64_t count, previous;
+	int s, d, m, best, fixed, shift;
+
+	hash_policy_init(hashtable);
+	if (hashtable->header || hashtable->stats || depth < 6) {
+		if (output) fprintf(output, "hash policy: fixed (hash from depth 2)\n");
+		return;
+	}
+
+	// sample depth, from the growth of the tree
+	previous = perft_stream(board, NULL, 3, bulk, do_quiet);
+	count = perft_stream(board, NULL, 4, bulk, do_quiet);
+	growth = log2((double) count / (previous + !previous));
+	for (s = depth - 2; s > 4 && growth * (depth - s) < 10; --s) ;
+	shift = (int) (growth * (depth - s) + 0.5);
+	hashtable->size = adapt_size(size, shift);
+	hashtable->small_mask = adapt_mask(small_mask, shift);
+	t = adapt_time(hashtable, board, s, bulk, do_quiet, &count);
+	ratio = ldexp(1.0, shift);
+	if (output) fprintf(output, "hash policy: sample perft %d in %.1f ms, with hashtables shrunk %llu times, full perft estimated in %.3f s\n", s, 1000 * t, (unsigned long long) (size / hashtable->size), t * ratio);
+	cost = budget * t * ratio;
+
+	for (int i = 0; i < (int) (sizeof order / sizeof order[0]); ++i) {
+		d = order[i];
+		if (d >= s || (d == 1 && bulk)) continue;
+		best = fixed = hashtable->policy[d];
+		for (m = 0; m < HASH_MODE_SIZE; ++m) time[m] = -1.0;
+		time[fixed] = t;
+		for (m = 0; m < HASH_MODE_SIZE; ++m) {
+			if (m == fixed) continue;
+			// a trial is about 3 sample searches
+			if (mperft_chrono() - start + 3 * t > cost) break;
+			hash_policy_set(hashtable, d, m);
+			time[m] = adapt_time(hashtable, board, s, bulk, do_quiet, &count);
+			if (time[m] < t * gain && (t - time[m]) * ratio > mperft_chrono() - start) best = m, t = time[m];
+			hash_policy_set(hashtable, d, best);
+		}
+		if (output) {
+			fprintf(output, "  depth %d:", d);
+			for (m = 0; m < HASH_MODE_SIZE; ++m) {
+				if (time[m] < 0.0) fprintf(output, " %s -%s", name[m], m < HASH_MODE_SIZE - 1 ? "," : "");
+				else fprintf(output, " %s %.2f ms%s", name[m], 1000 * time[m], m < HASH_MODE_SIZE - 1 ? "," : "");
+			}
+			fprintf(output, " -> %s\n", name[best]);
+		}
+	}
+	hashtable->size = size;
+	hashtable->small_mask = small_mask;
+	hash_clear(hashtable);
+
+	if (output) {
+		fprintf(output, "hash policy:");
+		for (d = 1; d <= 3; ++d) fprintf(output, " depth %d: %s,", d, name[hashtable->policy[d]]);
+		fprintf(output, " depth 4+: main; adapted in %.3f s (budget %.3f s)\n", mperft_chrono() - start, cost);
+	}
+}
+
+/* Progress of a long perft, updated & reported from the first plies only */
+typedef struct Progress {
+	HashTable *hashtable;
+	FILE *output;
+	const char *path;
+	volatile sig_atomic_t *dump;
+	double period, start, last_time, next_time;
+	Count leaves, last_leaves;
+	int index[PLY_SIZE];
+	int n_moves[PLY_SIZE];
+	int depth, split;
+	bool bulk, do_quiet;
+} Progress;
+
+/* Fraction of the tree done, from the moves completed at each expanded ply */
+static double progress_fraction(const Progress *progress, const int ply) {
+	double f = 0.0, scale = 1.0;
+
+	for (int i = 0; i <= ply; ++i) {
+		scale /= progress->n_moves[i];
+		f += progress->index[i] * scale;
+	}
+
+	return f;
+}
+
+/* Print the progress & rewrite the progress file */
+static void progress_report(Progress *progress, const int ply, const double time) {
+	const double f = progress_fraction(progress, ply), elapsed = time - progress->start;
+	const double speed = (double) (progress->leaves - progress->last_leaves) / (time - progress->last_time);
+	const double eta = f > 0.0 ? elapsed * (1.0 - f) / f : 0.0;
+	const double fill = progress->hashtable ? 100.0 * hash_fill(progress->hashtable) : 0.0;
+	char leaves[48], tmp[4096];
+	FILE *file;
+
+	count_to_string(progress->leaves, leaves);
+	fprintf(progress->output, "progress %2d : %6.2f%% root %d/%d ply 2 %d/%d %s leaves in %.3f s %.0f leaves/s hash %.1f%% eta %.0f s\n",
+		progress->depth, 100.0 * f, progress->index[0], progress->n_moves[0], ply > 0 ? progress->index[1] : 0, ply > 0 ? progress->n_moves[1] : 0,
+		leaves, elapsed, speed, fill, eta);
+	fflush(progress->output);
+	// write a temporary file renamed over the progress file, so a reader never sees it half written
+	if (progress->path && snprintf(tmp, sizeof tmp, "%s.tmp", progress->path) < (int) sizeof tmp && (file = fopen(tmp, "w")) != NULL) {
+		fprintf(file, "depth %d\ndone %.6f\nroot %d/%d\nply2 %d/%d\nleaves %s\nelapsed %.3f\nspeed %.0f\nhash %.1f\neta %.0f\n",
+			progress->depth, f, progress->index[0], progress->n_moves[0], ply > 0 ? progress->index[1] : 0, ply > 0 ? progress->n_moves[1] : 0,
+			leaves, elapsed, speed, fill, eta);
+		fclose(file);
+		rename(tmp, progress->path);
+	}
+	progress->last_time = time;
+	progress->last_leaves = progress->leaves;
+	progress->next_time = time + progress->period;
+}
+
+/* Expand the first plies, counting the subtrees below with perft_wide() & checking the time after each of them */
+static Count progress_search(Progress *progress, Board *board, const int depth, const int ply) {
+	Board next;
+	Count count = 0, c;
+	Move move;
+	MoveArray ma;
+	Key key;
+	bool hit, use_hash;
+	double time;
+
+	movearray_generate(&ma, board, progress->do_quiet || board->checkers);
+	progress->n_moves[ply] = ma.n > 0 ? ma.n : 1;
+	progress->index[ply] = 0;
+	while ((move = movearray_next(&ma)) != 0) {
+		key_update(&key, board, move);
+		board_copymake(board, move, &key, &next);
+		hit = false;
+		use_hash = progress->hashtable && (depth - 1 > WIDE_DEPTH || progress->hashtable->policy[depth - 1] != HASH_OFF);
+		if (use_hash) {
+			if (depth - 1 > WIDE_DEPTH) hit = progress->hashtable->wide && hash_probe_wide(progress->hashtable, &key, depth - 1, &c);
+			else hit = (c = hash_probe_policy(progress->hashtable, &key, depth - 1)) != 0;
+		}
+		if (!hit && depth - 1 > progress->split) c = progress_search(progress, &next, depth - 1, ply + 1);
+		else {
+			if (!hit) c = depth == 1 ? 1 : perft_wide(&next, progress->hashtable, depth - 1, progress->bulk, progress->do_quiet);
+			progress->leaves += c;
+		}
+		if (!hit && use_hash) {
+			if (depth - 1 > WIDE_DEPTH) {
+				if (progress->hashtable->wide) hash_store_wide(progress->hashtable, &key, depth - 1, c);
+			} else hash_store_policy(progress->hashtable, &key, depth - 1, c);
+		}
+		count += c;
+		++progress->index[ply];
+		time = mperft_chrono();
+		if (time >= progress->next_time || (progress->dump && *progress->dump)) {
+			if (progress->dump) *progress->dump = 0;
+			progress_report(progress, ply, time);
+		}
+	}
+
+	return count;
+}
+
+/* Perft reporting its progress every period seconds, or when *dump is set (e.g. by a signal handler), to output & to the file at path.
+ * Only the first plies, down to subtrees of at most 7 plies, are walked by the progress code; the deeper plies run the usual engine. */
+Count perft_progress(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet, const double period, const char *path, volatile sig_atomic_t *dump, FILE *output) {
+	Progress progress = {.hashtable = hashtable, .output = output, .path = path, .dump = dump, .period = period, .depth = depth, .bulk = bulk, .do_quiet = do_quiet};
+	Count count;
+
+	progress.split = depth - 2 < 7 ? depth - 2 : 7;
+	if (progress.split < 0) progress.split = 0;
+	progress.start = progress.last_time = mperft_chrono();
+	progress.next_time = progress.start + period;
+	count = progress_search(&progress, board, depth, 0);
+	progress_report(&progress, 0, mperft_chrono());
+
+	return count;
+}
+
+/* Update the keys of all the symmetries after a move is made */
+static inline void key_update_symmetries(Key next[SYMMETRY_SIZE], const Key keys[SYMMETRY_SIZE], const Board *board, const Move move) {
+	const Square from = move_from(move), to = move_to(move);
+	const Piece p = board_piece(board, from), promotion = move_promotion(move);
+
+	for (int s = SYMMETRY_NONE; s < SYMMETRY_SIZE; ++s) key_make_symmetry(next + s, keys + s, board->keys + s, board, from, to, p, promotion);
+}
+
+/* Canonical key: the smallest key among the applicable symmetries (left-right mirrors need all castling rights gone) */
+static inline const Key* key_canonical(const Key keys[SYMMETRY_SIZE], const int castling) {
+	const Key *key = keys;
+	const int n = castling ? SYMMETRY_MIRROR : SYMMETRY_SIZE;
+
+	for (int s = SYMMETRY_FLIP; s < n; ++s) if (keys[s].code < key->code) key = keys + s;
+
+	return key;
+}
+
+/* Perft sharing hashtable entries between color-flipped & mirrored positions */
+static uint64_t perft_symmetric(Board *board, const Key keys[SYMMETRY_SIZE], HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	Board next;
+	uint64_t count = 0, hash_count;
+	Move move;
+	MoveArray ma;
+	const bool use_keys = (hashtable && depth > hashtable->key_depth);
+	const bool use_hash = (use_keys && hashtable->policy[depth - 1] != HASH_OFF);
+	Key next_keys[SYMMETRY_SIZE];
+	const Key *key = NULL;
+
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+	// the leaves are only counted
+	if (depth == 1) return ma.n;
+
+	while ((move = movearray_next(&ma)) != 0) {
+		if (use_keys) {
+			key_update_symmetries(next_keys, keys, board, move);
+			key = key_canonical(next_keys, board->castling & MASK_CASTLING[move_from(move)] & MASK_CASTLING[move_to(move)]);
+			if (use_hash && hashtable->policy[depth - 1] == HASH_MAIN) hash_prefetch(hashtable, key);
+		}
+		board_copymake(board, move, next_keys, &next);
+		hash_count = use_hash ? hash_probe_policy(hashtable, key, depth - 1) : 0;
+		if (hash_count == 0) {
+			if (bulk && depth == 2) hash_count = generate_moves(&next, NULL, false, do_quiet || next.checkers);
+			else hash_count = perft_symmetric(&next, next_keys, hashtable, depth - 1, bulk, do_quiet);
+			if (use_hash) hash_store_policy(hashtable, key, depth - 1, hash_count);
+		}
+		count = count_add(count, hash_count);
+	}
+
+	return count;
+}
+
+/* Perft with symmetries from a root board */
+uint64_t perft_symmetry(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	Key keys[SYMMETRY_SIZE];
+
+	for (int s = SYMMETRY_NONE; s < SYMMETRY_SIZE; ++s) key_set_symmetry(keys + s, board, s);
+
+	return perft_symmetric(board, keys, hashtable, depth, bulk, do_quiet);
+}
+
+/* Iterative perft frame: the search state at a ply */
+typedef struct PerftFrame {
+	alignas(64) Board board;
+	MoveArray ma;
+	Key key;
+	uint64_t count;
+	int depth;
+	bool use_key;
+	bool use_hash;
+	bool store;
+} PerftFrame;
+
+/* Iterative perft search: a plain data structure that can be paused & resumed */
+struct PerftSearch {
+	PerftFrame frame[PLY_SIZE];
+	HashTable *hashtable;
+	uint64_t count;
+	int ply;
+	bool bulk;
+	bool do_quiet;
+	bool done;
+};
+
+/* Create an iterative perft search, with its preallocated per-ply arena; NULL on failure */
+PerftSearch* perft_search_create(void) {
+	PerftSearch *search = aligned_alloc(64, sizeof (PerftSearch));
+	if (search == NULL) memory_error(__func__);
+	return search;
+}
+
+/* Destroy an iterative perft search */
+void perft_search_destroy(PerftSearch *search) {
+	free(search);
+}
+
+/* Hash use of a frame, following the hash policy: the keys of its children & whether they are hashed */
+static inline void perft_frame_hash(PerftFrame *f, const HashTable *hashtable) {
+	f->use_key = (hashtable && f->depth > hashtable->key_depth);
+	f->use_hash = (f->use_key && hashtable->policy[f->depth - 1] != HASH_OFF);
+}
+
+/* Start an iterative perft search */
+void perft_search_start(PerftSearch *search, const Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	PerftFrame *f = search->frame;
+
+	search->hashtable = hashtable;
+	search->bulk = bulk;
+	search->do_quiet = do_quiet;
+	search->ply = 0;
+	search->count = 0;
+	search->done = false;
+	f->board = *board;
+	f->key = board->key;
+	f->count = 0;
+	f->depth = depth < PLY_SIZE - 1 ? depth : PLY_SIZE - 1;
+	perft_frame_hash(f, hashtable);
+	f->store = false;
+	movearray_generate(&f->ma, &f->board, do_quiet || f->board.checkers);
+}
+
+/* Run an iterative perft search for at most n_moves moves; return true once the search is done */
+bool perft_search_run(PerftSearch *search, uint64_t n_moves) {
+	PerftFrame *f = search->frame + search->ply, *next;
+	const bool bulk = search->bulk, do_quiet = search->do_quiet;
+	HashTable *hashtable = search->hashtable;
+	uint64_t count;
+	Move move;
+	Key key;
+
+	while (!search->done && n_moves--) {
+		// all moves done: return to the previous ply
+		if ((move = movearray_next(&f->ma)) == 0) {
+			if (f->store) hash_store_policy(hashtable, &f->key, f->depth, f->count);
+			if (f == search->frame) {
+				search->count = f->count;
+				search->done = true;
+			} else {
+				count = f->count;
+				--f;
+				f->count = count_add(f->count, count);
+				--search->ply;
+			}
+			continue;
+		}
+
+		// the leaves are only counted
+		if (f->depth == 1) {
+			f->count += f->ma.n;
+			f->ma.i = f->ma.n;
+			continue;
+		}
+		next = f + 1;
+		if (f->use_key) {
+			key_update(&key, &f->board, move);
+			if (f->use_hash && hashtable->policy[f->depth - 1] == HASH_MAIN) hash_prefetch(hashtable, &key);
+		}
+		board_copymake(&f->board, move, &key, &next->board);
+		if (f->use_hash && (count = hash_probe_policy(hashtable, &key, f->depth - 1)) != 0) f->count = count_add(f->count, count);
+		else if (bulk && f->depth == 2) {
+			count = generate_moves(&next->board, NULL, false, do_quiet || next->board.checkers);
+			if (f->use_hash) hash_store_policy(hashtable, &key, 1, count);
+			f->count += count;
+		}
+		// go to the next ply
+		else {
+			next->key = key;
+			next->count = 0;
+			next->depth = f->depth - 1;
+			perft_frame_hash(next, hashtable);
+			next->store = f->use_hash;
+			movearray_generate(&next->ma, &next->board, do_quiet || next->board.checkers);
+			f = next;
+			++search->ply;
+		}
+	}
+
+	return search->done;
+}
+
+/* Check if an iterative perft search is done */
+bool perft_search_done(const PerftSearch *search) {
+	return search->done;
+}
+
+/* Leaves counted by an iterative perft search: the final count once done, else the count so far */
+uint64_t perft_search_count(const PerftSearch *search) {
+	uint64_t count = 0;
+
+	if (search->done) return search->count;
+	for (int ply = 0; ply <= search->ply; ++ply) count = count_add(count, search->frame[ply].count);
+	return count;
+}
+
+/* Iterative Perft with optional hashtable, bulk counting & capture only generation */
+uint64_t perft_iterative(PerftSearch *search, const Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet) {
+	perft_search_start(search, board, hashtable, depth, bulk, do_quiet);
+	while (!perft_search_run(search, -1ull)) ;
+	return search->count;
+}
+
+/* Recursive Perft collecting detailed statistics, with optional hashtable */
+void perft_detailed(Board *board, HashTable *hashtable, const int depth, const bool do_quiet, Stats *stats) {
+	Board next;
+	Stats s;
+	Move move;
+	MoveArray ma;
+	const bool use_hash = (hashtable && depth > 2);
+	Key key;
+
+	if (depth == 1) {
+		stats_generate(board, do_quiet, stats);
+		return;
+	}
+
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+
+	while ((move = movearray_next(&ma)) != 0) {
+		if (use_hash) {
+			key_update(&key, board, move);
+			hash_prefetch(hashtable, &key);
+		}
+		board_copymake(board, move, &key, &next);
+		if (use_hash) {
+			if (!hash_probe_stats(hashtable, &key, depth - 1, &s)) {
+				s = (Stats) {0};
+				perft_detailed(&next, hashtable, depth - 1, do_quiet, &s);
+				hash_store_stats(hashtable, &key, depth - 1, &s);
+			}
+			stats_add(stats, &s);
+		} else perft_detailed(&next, hashtable, depth - 1, do_quiet, stats);
+	}
+}
+
+/* One Monte Carlo sample: a random path down to depth - exact, weighted by the branching factors, then an exact count of the subtree */
+static double estimate_sample(const Board *board, HashTable *hashtable, const int depth, const int exact, const bool bulk, const bool do_quiet, Random *random) {
+	Board b[2] = {*board};
+	Board *current = b, *next = b + 1, *tmp;
+	double weight = 1.0;
+	MoveArray ma;
+	Move move;
+	Key key;
+
+	for (int d = depth; d > exact; --d) {
+		movearray_generate(&ma, current, do_quiet || current->checkers);
+		if (ma.n == 0) return 0.0;
+		weight *= ma.n;
+		move = ma.move[(Count) random_get(random) * ma.n >> 64];
+		key_update(&key, current, move);
+		board_copymake(current, move, &key, next);
+		tmp = current, current = next, next = tmp;
+	}
+	if (exact > 0) weight *= (double) perft_stream(current, hashtable, exact, bulk, do_quiet);
+
+	return weight;
+}
+
+/* Monte Carlo perft estimate: sample for about the given time, printing the estimate with its 95% confidence
+ * interval each time the number of samples doubles. Each sample is an unbiased estimate (Knuth's method), so
+ * the interval shrinks as 1 / sqrt(samples). */
+double perft_estimate(const Board *board, HashTable *hashtable, const int depth, const int exact, const bool bulk, const bool do_quiet, const double seconds, const uint64_t seed, FILE *output) {
+	Random random[1];
+	const double start = mperft_chrono();
+	double x, delta, mean = 0.0, m2 = 0.0, error, time;
+	uint64_t n = 0, report = 16;
+
+	random_seed(random, seed);
+	do {
+		x = estimate_sample(board, hashtable, depth, exact < depth ? exact : depth, bulk, do_quiet, random);
+		delta = x - mean;
+		mean += delta / ++n;
+		m2 += delta * (x - mean);
+		time = mperft_chrono() - start;
+		if (n == report || time >= seconds) {
+			error = n > 1 ? 1.96 * sqrt(m2 / (n - 1) / n) : mean;
+			fprintf(output, "estimate %2d : %15.6e +/- %.2e leaves (%5.2f%%, 95%%) after %12llu samples in %10.3f s\n",
+				depth, mean, error, mean > 0.0 ? 100.0 * error / mean : 0.0, (unsigned long long) n, time);
+			fflush(output);
+			report *= 2;
+		}
+	} while (time < seconds);
+
+	return mean;
+}
+
+/* Position categories of a corpus */
+typedef enum { CORPUS_OPENING, CORPUS_MIDDLEGAME, CORPUS_ENDGAME, CORPUS_CHECK, CORPUS_SIZE } CorpusCategory;
+
+/* Category of a position reached after some plies of a game */
+static CorpusCategory corpus_category(const Board *board, const int ply) {
+	if (board->checkers) return CORPUS_CHECK;
+	if (ply < 24) return CORPUS_OPENING;
+	if (stdc_count_ones_ull(board->color[WHITE] | board->color[BLACK]) <= 12) return CORPUS_ENDGAME;
+	return CORPUS_MIDDLEGAME;
+}
+
+/* Corpus benchmark: play seeded random games from the board & keep <n> positions of each category, at most one
+ * per game & category, each candidate ply after the 8th being taken with a probability of 1/8. The positions
+ * are counted at <depth>, the throughput of each category is reported, and the corpus is saved into the EPD file
+ * <path>, if any, with the leaf counts. The corpus only depends on the board & the seed, so it is the same on every build & host.
+ * Return false on a memory or file error.
+ */
+bool perft_corpus(const Board *board, HashTable *hashtable, const int n, const int depth, const bool bulk, const bool do_quiet, const uint64_t seed, const char *path, FILE *output) {
+	static const char *name[CORPUS_SIZE] = {"opening", "middlegame", "endgame", "check"};
+	Board *corpus = malloc(CORPUS_SIZE * n * sizeof (Board));
+	Count *count = malloc(CORPUS_SIZE * n * sizeof (Count));
+	Board b[2], *current, *next, *tmp;
+	bool taken[CORPUS_SIZE];
+	int size[CORPUS_SIZE] = {0}, full = 0, games, ply, c, i;
+	Random random[1];
+	MoveArray ma;
+	Move move;
+	Key key;
+	CorpusCategory category;
+	Count leaves, total = 0;
+	double time, total_time = 0.0;
+	FILE *file;
+
+	if (corpus == NULL || count == NULL) {
+		memory_error(__func__);
+		free(count);
+		free(corpus);
+		return false;
+	}
+	random_seed(random, seed);
+
+	// random games, up to 400 plies each
+	for (games = 0; full < CORPUS_SIZE && games < 1000 * n; ++games) {
+		b[0] = *board;
+		current = b, next = b + 1;
+		for (c = 0; c < CORPUS_SIZE; ++c) taken[c] = false;
+		for (ply = 0; ply < 400; ++ply) {
+			movearray_generate(&ma, current, true);
+			if (ma.n == 0) break;
+			category = corpus_category(current, ply);
+			if (ply >= 8 && !taken[category] && size[category] < n && random_get(random) % 8 == 0) {
+				corpus[category * n + size[category]++] = *current;
+				taken[category] = true;
+				if (size[category] == n) ++full;
+			}
+			move = ma.move[(Count) random_get(random) * ma.n >> 64];
+			key_update(&key, current, move);
+			board_copymake(current, move, &key, next);
+			tmp = current, current = next, next = tmp;
+		}
+	}
+	fprintf(output, "corpus: %d positions per category from %d random games, seed %llu\n", n, games, (unsigned long long) seed);
+
+	// perft throughput per category
+	for (c = 0; c < CORPUS_SIZE; ++c) {
+		leaves = 0;
+		time = -mperft_chrono();
+		for (i = 0; i < size[c]; ++i) {
+			count[c * n + i] = perft_wide(corpus + c * n + i, hashtable, depth, bulk, do_quiet);
+			leaves += count[c * n + i];
+		}
+		time += mperft_chrono();
+		fprintf(output, "corpus %-10s : %4d positions %15s leaves in %10.3f s %12.0f leaves/s\n", name[c], size[c], count_to_string(leaves, NULL), time, (double) leaves / time);
+		total += leaves;
+		total_time += time;
+	}
+	fprintf(output, "corpus %-10s : %4d positions %15s leaves in %10.3f s %12.0f leaves/s\n", "total", size[0] + size[1] + size[2] + size[3], count_to_string(total, NULL), total_time, (double) total / total_time);
+
+	// EPD corpus, with the leaf count at depth
+	if (path) {
+		if ((file = fopen(path, "w")) == NULL) {
+			fprintf(stderr, "Error: cannot write the corpus '%s'\n", path);
+			free(count);
+			free(corpus);
+			return false;
+		}
+		for (c = 0; c < CORPUS_SIZE; ++c) for (i = 0; i < size[c]; ++i) {
+			fprintf(file, "%s id \"%s %d\"; D%d %s;\n", board_to_fen(corpus + c * n + i, NULL), name[c], i + 1, depth, count_to_string(count[c * n + i], NULL));
+		}
+		fclose(file);
+		fprintf(output, "corpus saved into '%s'\n", path);
+	}
+
+	free(count);
+	free(corpus);
+
+	return true;
+}
+
+/* Set of distinct positions: an open-addressed table of keys, placed by their 64-bit code & told apart by their
+ * 64-bit index. An interior node is stored too, as its key xored with a salt of its depth (zero at the leaves),
+ * so a subtree met again is pruned. */
+typedef struct UniqueSet {
+	Key *key;
+	size_t size;
+	uint64_t n_entries;
+	uint64_t leaves;
+	uint64_t marks;
+	uint64_t pruned;
+	uint64_t collisions;
+	double walked;
+	Key salt[PLY_SIZE];
+	int pass, n_passes;
+	bool full;
+} UniqueSet;
+
+/* Check if the side to play can legally capture en passant */
+static bool board_enpassant_legal(const Board *board) {
+	const Color c = board->player;
+	const Color o = opponent(c);
+	const Square k = board->x_king[c];
+	const Square to = board->enpassant;
+	const Square ep = to - PUSH[c];
+	const Bitboard occupied = board->color[WHITE] + board->color[BLACK];
+	const Bitboard bq = (board->piece[BISHOP] | board->piece[QUEEN]) & board->color[o];
+	const Bitboard rq = (board->piece[ROOK] | board->piece[QUEEN]) & board->color[o];
+	Bitboard pawns = MASK[ep].enpassant & board->piece[PAWN] & board->color[c], b;
+	Square from;
+
+	// a knight or another pawn giving check cannot be captured en passant
+	if ((knight_attack(k, board->piece[KNIGHT]) | pawn_attack(k, c, board->piece[PAWN] ^ square_to_bit(ep))) & board->color[o]) return false;
+	// a slider check or pin: the king is attacked once the capture is played
+	while (pawns) {
+		from = square_next(&pawns);
+		b = occupied ^ square_to_bit(from) ^ square_to_bit(ep) ^ square_to_bit(to);
+		if (!bishop_attack(b, k, bq) && !rook_attack(b, k, rq)) return true;
+	}
+	return false;
+}
+
+/* Key of a position in the set: its en passant square is dropped unless an en passant capture is legal */
+static inline void unique_key(Key *key, const Board *board) {
+	if (board_enpassant(board) && !board_enpassant_legal(board)) {
+		key_xor(key, board->keys->enpassant + board->enpassant);
+		key_xor(key, board->keys->enpassant + ENPASSANT_NONE);
+	}
+}
+
+/* Slot of a key in the set */
+static inline size_t unique_slot(const UniqueSet *set, const Key *key) {
+	return (size_t) (((Count) key->code * set->size) >> 64);
+}
+
+/* Insert a key into the set; return false if it is already there */
+static bool unique_insert(UniqueSet *set, const Key *key) {
+	size_t i = unique_slot(set, key);
+	uint64_t collisions = 0;
+
+	for (; set->key[i].code | set->key[i].index; i = (i + 1 < set->size ? i + 1 : 0)) {
+		if (set->key[i].code == key->code) {
+			if (set->key[i].index == key->index) return false;
+			++collisions;
+		}
+	}
+	set->key[i] = *key;
+	++set->n_entries;
+	set->collisions += collisions;
+
+	return true;
+}
+
+/* Insert the leaves of the current pass into the set, their slots being prefetched first; <share> is the fraction
+ * of the tree below the board */
+static void unique_leaves(UniqueSet *set, Board *board, const bool do_quiet, const double share) {
+	MoveArray ma;
+	Board next;
+	Key key[MOVE_SIZE];
+	Square from, to;
+	int i, n = 0;
+
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+	for (i = 0; i < ma.n; ++i) {
+		key_update(key + n, board, ma.move[i]);
+		// a double pawn push next to an opponent pawn: is its en passant square real?
+		from = move_from(ma.move[i]); to = move_to(ma.move[i]);
+		if (abs(to - from) == 16 && board_piece(board, from) == PAWN && (MASK[to].enpassant & board->piece[PAWN] & board->color[opponent(board->player)])) {
+			board_play(board, from, to, PAWN, 0, key + n, &next);
+			unique_key(key + n, &next);
+		}
+		// the leaves are partitioned between the passes by their index
+		if ((int) (((Count) key[n].index * set->n_passes) >> 64) != set->pass) continue;
+		_mm_prefetch((const char*) (set->key + unique_slot(set, key + n)), _MM_HINT_T0);
+		++n;
+	}
+	for (i = 0; i < n; ++i) {
+		if (set->n_entries >= set->size / 4 * 3) {
+			set->full = true;
+			set->walked += share * i / n;
+			return;
+		}
+		if (unique_insert(set, key + i)) ++set->leaves;
+	}
+	set->walked += share;
+}
+
+/* Walk the tree & insert the leaves of the current pass into the set */
+static void unique_search(UniqueSet *set, Board *board, const int depth, const bool do_quiet, const double share) {
+	MoveArray ma;
+	Move move;
+	Board next;
+	Key key, mark;
+	double child;
+
+	if (depth == 1) {
+		unique_leaves(set, board, do_quiet, share);
+		return;
+	}
+	movearray_generate(&ma, board, do_quiet || board->checkers);
+	if (ma.n == 0) set->walked += share;
+	child = share / ma.n;
+	while ((move = movearray_next(&ma)) && !set->full) {
+		key_update(&key, board, move);
+		board_copymake(board, move, &key, &next);
+		// interior marks fill at most a quarter of the set, leaving at least half of it to the leaves
+		if (set->marks < set->size / 4) {
+			mark = key;
+			unique_key(&mark, &next);
+			key_xor(&mark, set->salt + depth - 1);
+			if (!unique_insert(set, &mark)) {
+				++set->pruned;
+				set->walked += child;
+				continue;
+			}
+			++set->marks;
+		}
+		unique_search(set, &next, depth - 1, do_quiet, child);
+	}
+}
+
+/* Count the distinct positions reachable at exactly <depth> plies, within a set of <size> Mbytes. Positions are
+ * identified by their 128-bit key, so two positions that only share their 64-bit code are both counted, and these
+ * code collisions are reported with the count expected from random codes. If the set is too small, the tree is
+ * walked again in several passes, each one keeping a part of the leaves: their number is sized from the leaves
+ * found in the part of the tree walked before the set filled. The count is returned into <count>; false on a
+ * memory error. */
+bool perft_unique(const Board *board, const int depth, const size_t size, const bool do_quiet, uint64_t *count, FILE *output) {
+	UniqueSet set = {.n_passes = 1};
+	Random random[1];
+	Board root = *board;
+	uint64_t distinct = 0, marks = 0, pruned = 0, collisions = 0;
+	const double start = mperft_chrono();
+	double expected = 0.0, n_passes;
+	int d, walks = 0;
+	bool sized = false;
+
+	set.size = hash_size_entries(size, sizeof (Key));
+	set.key = malloc(set.size * sizeof (Key));
+	if (set.key == NULL) {
+		memory_error(__func__);
+		return false;
+	}
+	random_seed(random, 0x5A17);
+	for (d = 1; d < PLY_SIZE; ++d) key_init(set.salt + d, random);
+
+	if (depth == 0) distinct = 1;
+	else for (set.pass = 0; set.pass < set.n_passes; ++set.pass) {
+		memory_zero(set.key, set.size * sizeof (Key));
+		set.n_entries = set.leaves = set.marks = set.pruned = set.collisions = 0;
+		set.walked = 0.0;
+		unique_search(&set, &root, depth, do_quiet, 1.0);
+		++walks;
+		n_passes = set.n_passes;
+		// set full: the leaves of the whole tree, extrapolated from the walked part, with a 25% margin
+		if (set.full) n_passes = fmax(ceil(1.25 * set.leaves * set.n_passes / fmax(set.walked, 1e-6) / (set.size / 4 * 3 - set.marks)), 2.0 * set.n_passes);
+		// first pass done: the exact leaves of a pass, with a 10% margin, if sparing more than one walk
+		else if (set.pass == 0 && !sized) {
+			sized = true;
+			n_passes = ceil(1.1 * set.leaves * set.n_passes / (set.size / 4 * 3 - set.marks));
+			if (n_passes + 1 >= set.n_passes) n_passes = set.n_passes;
+		}
+		if (n_passes != set.n_passes) {
+			set.n_passes = (int) fmin(n_passes, 1 << 24);
+			set.pass = -1;
+			distinct = marks = pruned = collisions = 0;
+			expected = 0.0;
+			fprintf(output, "unique %2d : %s, restart with %d passes\n", depth, set.full ? "set full" : "set sized", set.n_passes);
+			fflush(output);
+			set.full = false;
+		} else {
+			distinct += set.leaves;
+			marks += set.marks;
+			pruned += set.pruned;
+			collisions += set.collisions;
+			expected += (double) set.n_entries * set.n_entries;
+		}
+	}
+
+	fprintf(output, "unique %2d : %15llu positions in %10.3f s\n", depth, (unsigned long long) distinct, mperft_chrono() - start);
+	fprintf(output, "unique set: %.1f Mbytes (%llu entries), %d pass%s in %d walk%s, %llu subtrees stored & %llu pruned\n",
+		(double) (set.size * sizeof (Key)) / (1 << 20), (unsigned long long) set.size, set.n_passes, set.n_passes > 1 ? "es" : "",
+		walks, walks > 1 ? "s" : "", (unsigned long long) marks, (unsigned long long) pruned);
+	fprintf(output, "collisions: %llu 64-bit code collisions found (%.2e expected), %.2e expected on the 128-bit keys\n",
+		(unsigned long long) collisions, expected / ldexp(1.0, 65), expected / ldexp(1.0, 129));
+
+	free(set.key);
+	*count = distinct;
+
+	return true;
+}
+
+/* Root move of a parallel div */
+typedef struct DivMove {
+	Move move;
+	Count count;
+	Stats stats;
+	double time;
+} DivMove;
+
+/* Parallel div: the root moves are shared between the threads, one move at a time */
+typedef struct Div {
+	Board *board;
+	HashTable *hashtable;
+	const Numa *numa;
+	FILE *output;
+	DivMove move[MOVE_SIZE];
+	int n_moves;
+	int next;
+	int depth;
+	bool bulk, do_quiet, detailed, symmetry;
+#if defined(__unix__) || defined(__APPLE__)
+	pthread_mutex_t lock;
+#endif
+} Div;
+
+typedef struct DivWorker {
+	Div *div;
+	int id;
+} DivWorker;
+
+/* Count the leaves after a root move */
+static void div_move(const Div *div, HashTable *hashtable, DivMove *m) {
+	Board next;
+	Key key;
+	const int depth = div->depth;
+
+	m->time = -mperft_chrono();
+	key_update(&key, div->board, m->move);
+	board_copymake(div->board, m->move, &key, &next);
+	if (div->detailed) {
+		if (depth == 1) m->stats.leaves = 1;
+		else perft_detailed(&next, hashtable, depth - 1, div->do_quiet, &m->stats);
+		m->count = m->stats.leaves;
+	} else if (depth == 1) m->count = 1;
+	else if (div->bulk && depth == 2) m->count = generate_moves(&next, NULL, false, div->do_quiet || next.checkers);
+	else {
+		if (div->symmetry) m->count = perft_symmetry(&next, hashtable, depth - 1, div->bulk, div->do_quiet);
+		// no symmetry, or a saturated 64-bit count: 128-bit counts
+		if (!div->symmetry || m->count == UINT64_MAX) m->count = perft_wide(&next, hashtable, depth - 1, div->bulk, div->do_quiet);
+	}
+	m->time += mperft_chrono();
+}
+
+/* Index of the next root move to search */
+static inline int div_next(Div *div) {
+#if defined(__unix__) || defined(__APPLE__)
+	return __atomic_fetch_add(&div->next, 1, __ATOMIC_RELAXED);
+#else
+	return div->next++;
+#endif
+}
+
+/* Search the root moves until none is left, printing each result as soon as it is known */
+static void* div_worker(void *data) {
+	DivWorker *worker = (DivWorker*) data;
+	Div *div = worker->div;
+	HashTable *hashtable = div->hashtable, part;
+	DivMove *m;
+	char move[8], count[48];
+	int i, node;
+
+	numa_pin(div->numa, worker->id);
+	// a partitioned hashtable: each thread only uses the part of its node
+	if (hashtable && !hashtable->header && div->numa->policy == NUMA_PARTITION && div->numa->n_nodes > 1) {
+		node = div->numa->node[numa_cpu(div->numa, worker->id)];
+		if (div->numa->affinity == AFFINITY_NONE) numa_pin_node(div->numa, node);
+		hash_partition(hashtable, div->numa, node, &part);
+		hashtable = &part;
+	}
+	while ((i = div_next(div)) < div->n_moves) {
+		m = div->move + i;
+		div_move(div, hashtable, m);
+	#if defined(__unix__) || defined(__APPLE__)
+		pthread_mutex_lock(&div->lock);
+	#endif
+		fprintf(div->output, "%5s %16s leaves in %10.3f s %12.0f leaves/s\n", move_to_string(m->move, move), count_to_string(m->count, count), m->time, (double) m->count / m->time);
+		fflush(div->output);
+	#if defined(__unix__) || defined(__APPLE__)
+		pthread_mutex_unlock(&div->lock);
+	#endif
+	}
+
+	return NULL;
+}
+
+/* Compare two root moves by their names */
+static int div_compare(const void *a, const void *b) {
+	char x[8], y[8];
+
+	return strcmp(move_to_string(((const DivMove*) a)->move, x), move_to_string(((const DivMove*) b)->move, y));
+}
+
+/* Run a div over n_threads threads, then print the counts sorted by move */
+static Count div_run(Div *div, const int n_threads, Stats *stats) {
+	DivWorker worker[CPU_SIZE];
+	MoveArray ma;
+	Move move;
+	Count total = 0;
+	int i, n = n_threads < 1 ? 1 : (n_threads > CPU_SIZE ? CPU_SIZE : n_threads);
+
+	movearray_generate(&ma, div->board, div->do_quiet || div->board->checkers);
+	for (div->n_moves = 0; (move = movearray_next(&ma)) != 0; ++div->n_moves) div->move[div->n_moves] = (DivMove) {.move = move};
+	div->next = 0;
+	if (n > div->n_moves) n = div->n_moves > 0 ? div->n_moves : 1;
+	for (i = 0; i < n; ++i) worker[i] = (DivWorker) {div, i};
+
+#if defined(__unix__) || defined(__APPLE__)
+	pthread_t thread[CPU_SIZE];
+
+	pthread_mutex_init(&div->lock, NULL);
+	for (i = 1; i < n; ++i) if (pthread_create(thread + i, NULL, div_worker, worker + i)) thread[i] = 0;
+	div_worker(worker);
+	for (i = 1; i < n; ++i) if (thread[i]) pthread_join(thread[i], NULL);
+	pthread_mutex_destroy(&div->lock);
+#else
+	div_worker(worker);
+#endif
+
+	qsort(div->move, div->n_moves, sizeof (DivMove), div_compare);
+	fputc('\n', div->output);
+	for (i = 0; i < div->n_moves; ++i) {
+		fprintf(div->output, "%5s %16s\n", move_to_string(div->move[i].move, NULL), count_to_string(div->move[i].count, NULL));
+		total += div->move[i].count;
+		if (div->detailed) stats_add(stats, &div->move[i].stats);
+	}
+
+	return total;
+}
+
+/* Parallel div from a board: each root move is printed with its time once searched, then all of them sorted by name */
+Count perft_div(Board *board, HashTable *hashtable, const Numa *numa, const int depth, const bool bulk, const bool do_quiet, const bool detailed, const bool symmetry, const int n_threads, Stats *stats, FILE *output) {
+	Div div = {.board = board, .hashtable = hashtable, .numa = numa, .output = output, .depth = depth, .bulk = bulk, .do_quiet = do_quiet, .detailed = detailed, .symmetry = symmetry};
+
+	return div_run(&div, n_threads > 0 ? n_threads : numa->n_cpus, stats);
+}
+
+/* test */
+void perft_test(const MPerft *mperft) {
+	Board board;
+	PerftSearch *search = perft_search_create(), *tmp;
+	HashTable *hashtable = hash_create(16, false);
+	if (search == NULL || hashtable == NULL) {
+		perft_search_destroy(search);
+		hash_destroy(hashtable);
+		return;
+	}
+	hash_reset(hashtable);
+	// the streaming, iterative & symmetric perfts run with a mixed hash policy
+	hash_policy_set(hashtable, 1, HASH_SMALL);
+	hash_policy_set(hashtable, 2, HASH_OFF);
+	hash_policy_set(hashtable, 3, HASH_SMALL);
+	typedef struct TestBoard {
+		char *comments, *fen;
+		unsigned long long result;
+		int depth;
 	} TestBoard;
 	TestBoard tests[] = {
 		{"1. Initial position ", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 119060324, 6},
@@ -1312,123 +4051,324 @@ void test(void) {
 	printf("Testing the board generator\n");
 	for (TestBoard *t = tests; t->fen != NULL; ++t) {
 		printf("Test %s %s", t->comments, t->fen); fflush(stdout);
-		board_set(&board, t->fen);
+		board_set(&board, mperft, t->fen);
 		unsigned long long count = perft(&board, NULL, t->depth, true, true);
-		if (count == t->result) printf(" passed\n"); else printf(" FAILED ! %llu != %llu\n", count, t->result);
+		hash_clear(hashtable);
+		unsigned long long count_stream = perft_stream(&board, hashtable, t->depth, true, true);
+		hash_clear(hashtable);
+		unsigned long long count_iterative = perft_iterative(search, &board, hashtable, t->depth, true, true);
+		hash_clear(hashtable);
+		unsigned long long count_symmetry = perft_symmetry(&board, hashtable, t->depth, true, true);
+		if (count == t->result && count_stream == t->result && count_iterative == t->result && count_symmetry == t->result) printf(" passed\n");
+		else printf(" FAILED ! %llu, %llu (streaming), %llu (iterative), %llu (symmetry) != %llu\n", count, count_stream, count_iterative, count_symmetry, t->result);
 	}
-}
 
-/* main */
-int main(int argc, char **argv) {
-	double full_time= -chrono(), partial_time = 0.0, total_time = 0.0;
-	alignas(64) Board board, next;
-	HashTable *hashtable = NULL;
-	Key key;
-	MoveArray ma;
-	unsigned long long count, total = 0;
-	uint64_t seed = 0xA170EBA;
-	char *fen = NULL;
-	int depth = 6, hash_size = 0, n_repetition = 1;
-	Move move;
-	bool div = false, capture = false, bulk = false, loop = false;
+	// iterative search paused every 1000 moves & resumed, handed over to another search structure half way
+	{
+		PerftSearch *other = perft_search_create();
+		uint64_t last = 0, count;
+		int n_slices = 0;
+		bool ok = other != NULL;
+
+		printf("Test paused iterative search %s at depth %d", tests[1].fen, tests[1].depth - 1); fflush(stdout);
+		board_set(&board, mperft, tests[1].fen);
+		hash_clear(hashtable);
+		perft_search_start(search, &board, hashtable, tests[1].depth - 1, true, true);
+		while (ok && !perft_search_run(search, 1000)) {
+			count = perft_search_count(search);
+			ok = count >= last && !perft_search_done(search);
+			last = count;
+			if (++n_slices == 100) {
+				memcpy(other, search, sizeof (PerftSearch));
+				memset(search, 0, sizeof (PerftSearch));
+				tmp = search, search = other, other = tmp;
+			}
+		}
+		if (ok && n_slices > 100 && perft_search_done(search) && perft_search_count(search) == 4085603) printf(" passed\n");
+		else printf(" FAILED ! %llu after %d slices\n", (unsigned long long) perft_search_count(search), n_slices);
+		perft_search_destroy(other);
+	}
 
-	puts("Magic Perft (c) version 2.0 Richard Delorme - 2026");
-#if HAS_PEXT
-	puts("Bitboard move generation based on magic (pext) bitboards");
-#else
-	puts("Bitboard move generation based on magic bitboards");
-#endif
+	// detailed statistics, sequential & by a parallel div through a statistics hashtable
+	{
+		typedef struct TestStats {
+			int test, depth;
+			Stats stats;
+		} TestStats;
+		const TestStats expected[] = {
+			{0, 5, {4865609, 82719, 258, 0, 0, 27351, 6, 0, 347}},
+			{1, 4, {4085603, 757163, 1929, 128013, 15172, 25523, 42, 6, 43}},
+			{2, 5, {674624, 52051, 1165, 0, 0, 52950, 1292, 3, 0}},
+			{3, 4, {422333, 131393, 0, 7795, 60032, 15492, 19, 0, 5}},
+		};
+		Numa numa = {.policy = NUMA_NONE, .affinity = AFFINITY_NONE};
+		HashTable *stats_table = hash_create(16, true);
+		FILE *sink = tmpfile();
+		Stats stats, div_stats;
+
+		numa_init(&numa, 0);
+		if (stats_table) hash_reset(stats_table);
+		for (int i = 0; i < 4; ++i) {
+			const TestStats *t = expected + i;
+			printf("Test detailed statistics %s at depth %d", tests[t->test].fen, t->depth); fflush(stdout);
+			board_set(&board, mperft, tests[t->test].fen);
+			stats = div_stats = (Stats) {0};
+			perft_detailed(&board, NULL, t->depth, true, &stats);
+			if (stats_table && sink) {
+				hash_clear(stats_table);
+				perft_div(&board, stats_table, &numa, t->depth, false, true, true, false, 2, &div_stats, sink);
+			}
+			if (stats_table && sink && !memcmp(&stats, &t->stats, sizeof stats) && !memcmp(&div_stats, &t->stats, sizeof stats)) printf(" passed\n");
+			else {
+				printf(" FAILED !\n");
+				stats_print(&stats, stdout);
+				stats_print(&div_stats, stdout);
+			}
+		}
+		if (sink) fclose(sink);
+		hash_destroy(stats_table);
+	}
 
+	// distinct positions, in one pass or, with a small set, in several passes
+	{
+		const struct { int depth; size_t size; uint64_t count; } expected[] = {{5, 16, 822518}, {5, 1, 822518}, {6, 256, 9417681}};
+		FILE *sink = tmpfile();
+		uint64_t count;
+
+		board_init(&board, mperft);
+		for (int i = 0; i < 3; ++i) {
+			printf("Test unique positions at depth %d in %zu Mbytes", expected[i].depth, expected[i].size); fflush(stdout);
+			count = 0;
+			if (sink && perft_unique(&board, expected[i].depth, expected[i].size, true, &count, sink) && count == expected[i].count) printf(" passed\n");
+			else printf(" FAILED ! %llu != %llu\n", (unsigned long long) count, (unsigned long long) expected[i].count);
+		}
+		if (sink) fclose(sink);
+	}
 
-	// argument
-	for (int i = 1; i < argc; ++i) {
-		if (!strcmp(argv[i], "--fen") || !strcmp(argv[i], "-f")) fen = argv[++i];
-		else if (!strcmp(argv[i], "--kiwipete") || !strcmp(argv[i], "-k")) fen = "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1";
-		else if (!strcmp(argv[i], "--depth") || !strcmp(argv[i], "-d")) depth = atoi(argv[++i]);
-		else if (!strcmp(argv[i], "--bulk") || !strcmp(argv[i], "-b")) bulk = true;
-		else if (!strcmp(argv[i], "--div")) div = true;
-		else if (!strcmp(argv[i], "--capture") || !strcmp(argv[i], "-c")) capture = true;
-		else if (!strcmp(argv[i], "--loop") || !strcmp(argv[i], "-l")) loop = true;
-		else if (isdigit((int) argv[i][0])) depth = atoi(argv[i]);
-		else if (i < argc - 1 && (!strcmp(argv[i], "--repeat") || !strcmp(argv[i], "-r"))) n_repetition=atoi(argv[++i]);
-		else if (i < argc - 1 && (!strcmp(argv[i], "--hash") || !strcmp(argv[i], "-h"))) hash_size = atoi(argv[++i]);
-		else if (i < argc - 1 && (!strcmp(argv[i], "--seed") || !strcmp(argv[i], "-s"))) seed = atoi(argv[++i]);
-		else if (!strcmp(argv[i], "--test") || !strcmp(argv[i], "-t")) {
-			init(seed);
-			test();
-			return 0;
-		} else {
-			printf("%s <args> \n", argv[0]);
-			puts("Enumerate moves. The following options are available:");
-			puts("\t--help|-?            Print this message.");
-			puts("\t--fen|-f <fen>       Use the position indicated in FEN format (default=starting position).");
-			puts("\t--kiwipete|-k        Use the kiwipete position.");
-			puts("\t--depth|-d <depth>   Test up to this depth (default=6).");
-			puts("\t--bulk|-b            Do fast bulk counting at the last ply.");
-			puts("\t--hash|-h <size>     Use a hashtable with <size> Megabytes (default 0, no hashtable).");
-			puts("\t--capture|-c         Generate only captures, promotions & check evasions.");
-			puts("\t--div                Print a node count for each move.");
-			puts("\t--seed|-s <seed>     Change the seed of the pseudo move generator to <seed>.");
-			puts("\t--loop|-l            Loop from depth 1 to <depth>.");
-			puts("\t--repeat|-r <n>      Repeat the test <n> time (default = 1).");
-			puts("\t--test|-t            Run an internal test to check the move generator.");
-			return 0;
-		}
-	}
-
-	// post-initialisation
-	init(seed);
-	board_init(&board);
-	if (hash_size > 0) hashtable = hash_create(hash_size);
-	if (fen) board_set(&board, fen);
-	if (depth < 1) depth = 1;
-	if (depth > 64) depth = 64;
-	if (n_repetition < 1) n_repetition = 1;
-
-	printf("Perft setting: ");
-	if (hash_size == 0) printf("no hashing; ");
-	else printf("hashtable size: %u Mbytes (%llu entries); ", (unsigned) (sizeof (Hash) * (hashtable->mask + BUCKET_SIZE + 1) >> 20), (unsigned long long) (hashtable->mask + BUCKET_SIZE + 1));
-	if (bulk) printf("with"); else printf("no"); printf(" bulk counting;");
-	if (capture) printf(" capture only;");
-	puts("");
-	board_print(&board, stdout);
-
-	// root search
-	if (div) {
-		movearray_generate(&ma, &board, !capture || board.checkers);
-		while ((move = movearray_next(&ma)) != 0) {
-			partial_time = -chrono();
-			key_update(&key, &board, move);
-			board_copymake(&board, move, &key, &next);
-			if (depth == 1) count = 1;
-			else if (bulk && depth == 2) count = generate_moves(&next, NULL, false, !capture || next.checkers);
-			else count = perft(&next, hashtable, depth - 1, bulk, !capture);
-			total += count;
-			partial_time += chrono();
-			total_time += partial_time;
-			printf("%5s %16llu leaves in %10.3f s %12.0f leaves/s\n", move_to_string(move, NULL), count, partial_time, count / partial_time);
+	// hash verification: exact counts from a tiny hashtable, with a report of the false matches
+	{
+		HashTable *tiny = hash_create(1, false);
+		FILE *sink = tmpfile();
+		unsigned long long count = 0, entries = 0, probes = 0, hits = 0, candidates = 0;
+		double bits = 0.0;
+		bool ok = false;
+
+		printf("Test hash verification %s at depth %d", tests[1].fen, tests[1].depth); fflush(stdout);
+		board_set(&board, mperft, tests[1].fen);
+		if (tiny && sink && hash_verify_create(tiny)) {
+			hash_reset(tiny);
+			count = perft_verify(&board, tiny, tests[1].depth, true, true);
+			hash_verify_report(tiny, sink);
+			rewind(sink);
+			ok = count == tests[1].result && tiny->verify->hits > 0 && tiny->verify->candidates > 0
+			  && fscanf(sink, "hash verification: %llu entries (%lf index bits), %llu probes, %llu hits, %llu other", &entries, &bits, &probes, &hits, &candidates) == 5
+			  && entries == hash_entries(tiny) && probes == tiny->verify->probes && hits == tiny->verify->hits && candidates == tiny->verify->candidates;
 		}
-	} else {
-		for (int r = 1; r <= n_repetition; ++r) {
-			for (int d = (loop ? 1 : depth); d <= depth; ++d) {
-				if (hashtable) hash_clear(hashtable);
-				partial_time = -chrono();
-				count = perft(&board, hashtable, d, bulk, !capture);
-				total += count;
-				partial_time += chrono();
-				total_time += partial_time;
-				printf("perft %2d : %15llu leaves in %10.3f s %12.0f leaves/s\n", d, count, partial_time, count / partial_time);
+		if (ok) printf(" passed\n");
+		else printf(" FAILED ! %llu leaves, %llu probes, %llu hits, %llu other positions\n", count, probes, hits, candidates);
+		if (sink) fclose(sink);
+		hash_destroy(tiny);
+	}
+
+	// Monte Carlo estimate: exact if the whole tree is counted, else the same for the same seed
+	{
+		FILE *sink = tmpfile();
+		Random random[2];
+		double sum[2] = {0.0, 0.0};
+		bool ok = false;
+
+		printf("Test perft estimate"); fflush(stdout);
+		board_init(&board, mperft);
+		if (sink) {
+			ok = perft_estimate(&board, NULL, 5, 5, true, true, 0.01, 0x5EED, sink) == 4865609.0;
+			ok &= perft_estimate(&board, NULL, 6, 3, true, true, 0.0, 0x5EED, sink) == perft_estimate(&board, NULL, 6, 3, true, true, 0.0, 0x5EED, sink);
+			for (int i = 0; i < 2; ++i) {
+				random_seed(random + i, 0x5EED);
+				for (int j = 0; j < 256; ++j) sum[i] += estimate_sample(&board, NULL, 6, 2, true, true, random + i);
 			}
+			ok &= sum[0] == sum[1] && sum[0] > 0.0;
+			fclose(sink);
 		}
+		if (ok) printf(" passed\n");
+		else printf(" FAILED ! %.0f != %.0f\n", sum[0], sum[1]);
 	}
-	if (div || loop || n_repetition > 1) printf("total    : %15llu leaves in %10.3f s %12.0f leaves/s\n", total, total_time, total / total_time);
 
+	// 128-bit counts: the wide perft from a low depth, with & without hashtable, a count above 2^64 & a saturated one
+	{
+		const Count big = ((Count) 3 << 64) + 5;
+		char s[48];
+		bool ok;
+
+		printf("Test 128-bit counts"); fflush(stdout);
+		board_set(&board, mperft, tests[1].fen);
+		hash_clear(hashtable);
+		ok = perft_wide_depth(&board, hashtable, tests[1].depth, 2, true, true) == tests[1].result;
+		ok &= perft_wide_depth(&board, NULL, tests[1].depth, 2, true, true) == perft_stream(&board, NULL, tests[1].depth, true, true);
+		ok &= !strcmp(count_to_string(big, s), "55340232221128654853");
+		ok &= count_add(UINT64_MAX - 1, 2) == UINT64_MAX;
+		if (ok) printf(" passed\n");
+		else printf(" FAILED !\n");
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	// the capture & the full counts of a server share its hashtable
+	{
+		char commands[] = "fen kiwipete\nperft 4 capture\nperft 4\nperft 4 capture\nquit\n", *replies = NULL, *line;
+		const unsigned long long expected[] = {3690, 4085603, 3690};
+		unsigned long long count;
+		size_t size = 0;
+		FILE *input = fmemopen(commands, strlen(commands), "r"), *output = open_memstream(&replies, &size);
+		int n = 0;
+		bool ok = true;
+
+		printf("Test server capture & full counts"); fflush(stdout);
+		hash_clear(hashtable);
+		server_run(input, output, mperft, &board, hashtable);
+		fclose(input);
+		fclose(output);
+		for (line = replies; (line = strstr(line, "ok ")) != NULL; ++line) {
+			if (sscanf(line, "ok %llu", &count) == 1) ok &= n < 3 && count == expected[n++];
+		}
+		if (ok && n == 3) printf(" passed\n");
+		else printf(" FAILED !\n%s", replies);
+		free(replies);
+	}
+#endif
 	hash_destroy(hashtable);
-	free(MASK->bishop.attack);
-	free(MASK->rook.attack);
+	perft_search_destroy(search);
+}
+
+/* Serve perft requests read from input, one per line; return false on quit.
+ * Commands are:
+ *   fen <fen>                                    set the position (or 'fen startpos' / 'fen kiwipete')
+ *   perft <depth> [bulk] [capture] [detailed]    count the leaves at <depth>
+ *   div <depth> [bulk] [capture] [detailed]      count the leaves at <depth> after each move
+ *   clear                                        clear the hashtable
+ *   quit                                         stop the server
+ * Each reply ends with a line starting with 'ok' or 'error'.
+ */
+bool server_run(FILE *input, FILE *output, const MPerft *mperft, Board *board, HashTable *hashtable) {
+	char line[4096], *s, *command, *option;
+	Board b, next;
+	MoveArray ma;
+	Move move;
+	Key key;
+	Stats stats;
+	Count count, total;
+	double time;
+	int depth;
+	bool bulk, capture, detailed;
+
+	while (fgets(line, sizeof line, input)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		s = line;
+		command = parse_word(&s);
+		if (command == NULL) continue;
+
+		if (!strcmp(command, "quit")) {
+			fputs("ok\n", output); fflush(output);
+			return false;
+		} else if (!strcmp(command, "clear")) {
+			if (hashtable) hash_clear(hashtable);
+			fputs("ok\n", output);
+		} else if (!strcmp(command, "fen")) {
+			s = parse_next(s);
+			if (!strcmp(s, "startpos")) {
+				board_init(board, mperft);
+				fputs("ok\n", output);
+			} else if (!strcmp(s, "kiwipete")) {
+				board_set(board, mperft, "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1");
+				fputs("ok\n", output);
+			} else if (board_set(&b, mperft, s)) {
+				*board = b;
+				fputs("ok\n", output);
+			} else fputs("error bad fen\n", output);
+		} else if (!strcmp(command, "perft") || !strcmp(command, "div")) {
+			option = parse_word(&s);
+			depth = option ? atoi(option) : 0;
+			bulk = capture = detailed = false;
+			while ((option = parse_word(&s)) != NULL) {
+				if (!strcmp(option, "bulk")) bulk = true;
+				else if (!strcmp(option, "capture")) capture = true;
+				else if (!strcmp(option, "detailed")) detailed = true;
+			}
+			if (depth < 1 || depth > 64) {
+				fputs("error bad depth\n", output);
+			} else if (hashtable && detailed != (hashtable->stats != NULL)) {
+				fputs("error hashtable format mismatch\n", output);
+			} else if (hashtable && hashtable->header && hashtable->do_quiet == capture) {
+				fputs("error hashtable mode mismatch\n", output);
+			} else {
+				// the entries of the capture & the full counts share the same keys: forget the ones of the other mode
+				if (hashtable && hashtable->do_quiet == capture) {
+					hash_clear(hashtable);
+					hashtable->do_quiet = !capture;
+				}
+				time = -mperft_chrono();
+				total = 0;
+				stats = (Stats) {0};
+				if (command[0] == 'd') {
+					movearray_generate(&ma, board, !capture || board->checkers);
+					while ((move = movearray_next(&ma)) != 0) {
+						key_update(&key, board, move);
+						board_copymake(board, move, &key, &next);
+						if (detailed) {
+							Stats move_stats = {0};
+							if (depth == 1) move_stats.leaves = 1;
+							else perft_detailed(&next, hashtable, depth - 1, !capture, &move_stats);
+							stats_add(&stats, &move_stats);
+							count = move_stats.leaves;
+						} else if (depth == 1) count = 1;
+						else if (bulk && depth == 2) count = generate_moves(&next, NULL, false, !capture || next.checkers);
+						else count = perft_wide(&next, hashtable, depth - 1, bulk, !capture);
+						fprintf(output, "%s %s\n", move_to_string(move, NULL), count_to_string(count, NULL));
+						total += count;
+					}
+				} else if (detailed) {
+					perft_detailed(board, hashtable, depth, !capture, &stats);
+					total = stats.leaves;
+				} else total = perft_wide(board, hashtable, depth, bulk, !capture);
+				time += mperft_chrono();
+				if (detailed) stats_print(&stats, output);
+				fprintf(output, "ok %s %.6f\n", count_to_string(total, NULL), time);
+			}
+		} else fprintf(output, "error unknown command %s\n", command);
+		fflush(output);
+	}
 
-	full_time += chrono();
-	printf("full time: %10.3f s\n", full_time);
+	return true;
+}
 
-	return 0;
+#if defined(__unix__) || defined(__APPLE__)
+/* Serve perft requests from a Unix socket, one client after the other; false if the socket cannot be opened */
+bool server_socket(const char *path, const MPerft *mperft, Board *board, HashTable *hashtable) {
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	FILE *input, *output;
+	int fd, connection;
+	bool loop = true;
+
+	if (strlen(path) >= sizeof address.sun_path) {
+		fprintf(stderr, "Error: socket path too long '%s'\n", path);
+		return false;
+	}
+	strcpy(address.sun_path, path);
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof address) < 0 || listen(fd, 8) < 0) {
+		perror("Error: socket");
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	while (loop && (connection = accept(fd, NULL, NULL)) >= 0) {
+		input = fdopen(connection, "r");
+		output = fdopen(dup(connection), "w");
+		if (input && output) loop = server_run(input, output, mperft, board, hashtable);
+		if (input) fclose(input); else close(connection);
+		if (output) fclose(output);
+	}
+	close(fd);
+	unlink(path);
+
+	return true;
 }
+#endif
@@ -0,0 +1,161 @@
+/*
+ * mperft.h
+ *
+ * libmperft: perft using magic bitboard & transposition table.
+ * All the state lives in the context, the boards & the hashtables the caller passes in,
+ * so distinct threads may run perft concurrently, sharing a hashtable or not.
+ * Errors are printed on stderr & returned to the caller (NULL or false), never by exiting; a 64-bit perft count
+ * that overflows saturates to UINT64_MAX, & perft_wide() then searches it again with 128-bit counts.
+ *
+ * © 2020-2056 Richard Delorme
+ * version 2.0
+ */
+
+#ifndef MPERFT_H
+#define MPERFT_H
+
+/* Includes */
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* fast PEXT availability */
+#if (defined(__BMI2__) && !defined(__znver1__) && !defined(__znver2__))
+	#define HAS_PEXT 1
+#endif
+
+/* Types */
+typedef enum {GAME_SIZE = 4096, MOVE_SIZE = 256, CPU_SIZE = 1024, NODE_SIZE = 64, PLY_SIZE = 65} Limits;
+
+typedef uint64_t Bitboard;
+
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 Count;
+#else
+	typedef unsigned _BitInt(128) Count;
+#endif
+
+typedef enum { WHITE, BLACK, COLOR_SIZE } Color;
+
+typedef enum { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING, PIECE_SIZE } Piece;
+
+typedef uint16_t Move;
+
+typedef struct Key {
+	uint64_t code;
+	uint64_t index;
+} Key;
+
+typedef struct KeyTable KeyTable;
+
+typedef struct Board {
+	Bitboard piece[PIECE_SIZE];
+	Bitboard color[COLOR_SIZE];
+	Bitboard pinned;
+	Bitboard checkers;
+	const KeyTable *keys;
+	Key key;
+	uint16_t ply;
+	uint8_t x_king[COLOR_SIZE];
+	uint8_t player;
+	uint8_t castling;
+	uint8_t enpassant;
+} Board;
+
+typedef struct Stats {
+	uint64_t leaves;
+	uint64_t captures;
+	uint64_t enpassants;
+	uint64_t castles;
+	uint64_t promotions;
+	uint64_t checks;
+	uint64_t discovery_checks;
+	uint64_t double_checks;
+	uint64_t checkmates;
+} Stats;
+
+typedef enum { NUMA_NONE, NUMA_INTERLEAVE, NUMA_PARTITION } NumaPolicy;
+
+typedef enum { AFFINITY_NONE, AFFINITY_COMPACT, AFFINITY_SCATTER } AffinityPolicy;
+
+typedef struct Numa {
+	int cpu[CPU_SIZE];
+	int node[CPU_SIZE];
+	int n_cpus;
+	int n_nodes;
+	NumaPolicy policy;
+	AffinityPolicy affinity;
+	bool simulated;
+} Numa;
+
+typedef struct MPerft MPerft;
+
+typedef struct HashTable HashTable;
+
+typedef struct PerftSearch PerftSearch;
+
+/* Context */
+MPerft* mperft_create(const uint64_t seed);
+void mperft_destroy(MPerft *mperft);
+
+/* Miscellaneous */
+double mperft_chrono(void);
+char* count_to_string(Count count, char *s);
+char* move_to_string(const Move move, char *s);
+
+/* Board */
+void board_init(Board *board, const MPerft *mperft);
+bool board_set(Board *board, const MPerft *mperft, char *string);
+void board_print(const Board *board, FILE *output);
+char* board_to_fen(const Board *board, char *s);
+
+/* Hashtable. The entries of a table from hash_create() are left uninitialized, so their pages are only placed
+ * by their first touch: call hash_reset(), or hash_place() for a NUMA placement, before the first perft. */
+HashTable* hash_create(const size_t size, const bool detailed);
+size_t hash_auto_size(void);
+HashTable* hash_create_shared(const char *name, const size_t size, const uint64_t seed, const bool do_quiet);
+void hash_destroy(HashTable *hashtable);
+size_t hash_entries(const HashTable *hashtable);
+size_t hash_bytes(const HashTable *hashtable);
+void hash_reset(HashTable *hashtable);
+void hash_clear(HashTable *hashtable);
+double hash_fill(const HashTable *hashtable);
+bool hash_verify_create(HashTable *hashtable);
+void hash_verify_report(const HashTable *hashtable, FILE *output);
+void hash_adapt(HashTable *hashtable, Board *board, const int depth, const bool bulk, const bool do_quiet, FILE *output);
+
+/* Numa */
+void numa_init(Numa *numa, const int n_nodes);
+void numa_pin(const Numa *numa, const int worker);
+void hash_place(HashTable *hashtable, const Numa *numa);
+void hash_numa_report(const HashTable *hashtable, const Numa *numa, FILE *output);
+
+/* Perft */
+uint64_t perft(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+uint64_t perft_stream(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+Count perft_wide(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+uint64_t perft_verify(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+uint64_t perft_symmetry(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+PerftSearch* perft_search_create(void);
+void perft_search_destroy(PerftSearch *search);
+void perft_search_start(PerftSearch *search, const Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+bool perft_search_run(PerftSearch *search, uint64_t n_moves);
+bool perft_search_done(const PerftSearch *search);
+uint64_t perft_search_count(const PerftSearch *search);
+uint64_t perft_iterative(PerftSearch *search, const Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet);
+void perft_detailed(Board *board, HashTable *hashtable, const int depth, const bool do_quiet, Stats *stats);
+Count perft_progress(Board *board, HashTable *hashtable, const int depth, const bool bulk, const bool do_quiet, const double period, const char *path, volatile sig_atomic_t *dump, FILE *output);
+bool perft_corpus(const Board *board, HashTable *hashtable, const int n, const int depth, const bool bulk, const bool do_quiet, const uint64_t seed, const char *path, FILE *output);
+bool perft_unique(const Board *board, const int depth, const size_t size, const bool do_quiet, uint64_t *count, FILE *output);
+double perft_estimate(const Board *board, HashTable *hashtable, const int depth, const int exact, const bool bulk, const bool do_quiet, const double seconds, const uint64_t seed, FILE *output);
+Count perft_div(Board *board, HashTable *hashtable, const Numa *numa, const int depth, const bool bulk, const bool do_quiet, const bool detailed, const bool symmetry, const int n_threads, Stats *stats, FILE *output);
+void stats_print(const Stats *stats, FILE *output);
+
+/* Test & servers */
+void perft_test(const MPerft *mperft);
+bool server_run(FILE *input, FILE *output, const MPerft *mperft, Board *board, HashTable *hashtable);
+bool server_socket(const char *path, const MPerft *mperft, Board *board, HashTable *hashtable);
+
+#endif